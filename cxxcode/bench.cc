@@ -0,0 +1,312 @@
+// Name: bench.cc
+// Date: Oct. 17, 2026
+//
+// Micro-benchmarks of the hot paths on a synthetic corpus,
+// one JSON object per line and phase
+
+#include "dynet/globals.h"
+#include "dynet/nodes.h"
+#include "dynet/dynet.h"
+#include "dynet/training.h"
+#include "dynet/lstm.h"
+#include "dynet/dict.h"
+#include "dynet/expr.h"
+#include "dynet/model.h"
+
+#include "textclass.h"
+#include "sparse.h"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <sstream>
+
+namespace po = boost::program_options;
+
+typedef chrono::steady_clock Clock;
+
+// shape of the synthetic docs; counts are drawn uniformly
+// from [1, max]
+struct GenOptions{
+  unsigned ndocs;
+  unsigned nedus; // max EDUs per doc
+  unsigned edulen; // max tokens per EDU
+  unsigned depth; // max depth of a tree, the root has depth 0
+  unsigned branch; // max children of an EDU
+  unsigned vocab;
+  unsigned nclass;
+  unsigned ndisrela;
+};
+
+// *******************************************************
+// write a synthetic corpus in the format of read_corpus
+//
+// EDUs get their parents in order, each one picks a random
+// EDU that is not too deep and not full yet, so a doc may
+// end up with fewer EDUs than drawn
+// *******************************************************
+static void generate_corpus(const string& fname, const GenOptions& opts,
+			    mt19937& rng){
+  ofstream out(fname);
+  out << "synthetic corpus" << endl;
+  auto draw = [&](unsigned max_n){
+    return uniform_int_distribution<unsigned>(1, max(max_n, (unsigned)1))(rng);
+  };
+  for (unsigned k = 0; k < opts.ndocs; k++){
+    unsigned n_edus = draw(opts.nedus);
+    vector<unsigned> depth(1, 0), n_children(1, 0);
+    vector<int> parents(1, -1);
+    vector<unsigned> open(1, 0); // EDUs that can take a child
+    while ((parents.size() < n_edus) and (open.size() > 0)){
+      unsigned pos = uniform_int_distribution<unsigned>(0, open.size() - 1)(rng);
+      unsigned pidx = open[pos];
+      unsigned eidx = parents.size();
+      parents.push_back(pidx);
+      depth.push_back(depth[pidx] + 1);
+      n_children.push_back(0);
+      if (++ n_children[pidx] >= opts.branch){
+	open[pos] = open.back();
+	open.pop_back();
+      }
+      if ((depth[eidx] < opts.depth) and (opts.branch > 0)) open.push_back(eidx);
+    }
+    for (unsigned eidx = 0; eidx < parents.size(); eidx++){
+      unsigned ridx = uniform_int_distribution<unsigned>(0, opts.ndisrela - 1)(rng);
+      out << eidx << "\t" << parents[eidx] << "\t" << ridx << "\t";
+      unsigned n_token = draw(opts.edulen);
+      for (unsigned t = 0; t < n_token; t++){
+	unsigned widx = uniform_int_distribution<unsigned>(0, opts.vocab - 1)(rng);
+	out << (t > 0 ? " " : "") << "w" << widx;
+      }
+      out << endl;
+    }
+    unsigned label = uniform_int_distribution<unsigned>(0, opts.nclass - 1)(rng);
+    out << "=\tdoc" << k << ".txt\t" << label << endl;
+  }
+  out.close();
+}
+
+static double seconds(Clock::time_point from, Clock::time_point to){
+  return chrono::duration<double>(to - from).count();
+}
+
+// one result line: the run config, the phase and its timing,
+// then any extra fields
+// the parallel reader must give the docs and the word ids
+// of the serial one
+static bool same_corpus(const Corpus& a, const Corpus& b){
+  if (a.size() != b.size()) return false;
+  for (unsigned i = 0; i < a.size(); i++){
+    const Doc& x = a[i];
+    const Doc& y = b[i];
+    if ((x.filename() != y.filename()) or (x.label != y.label) or (x.root != y.root)
+	or (x.n_edus() != y.n_edus()) or (x.n_order != y.n_order))
+      return false;
+    for (unsigned e = 0; e < x.n_edus(); e++){
+      EduView ex = x.edu(e), ey = y.edu(e);
+      if ((x.rela(e) != y.rela(e)) or (ex.size() != ey.size())
+	  or (!equal(ex.begin(), ex.end(), ey.begin())))
+	return false;
+      NodeList cx = x.children(e), cy = y.children(e);
+      if ((cx.size() != cy.size()) or (!equal(cx.begin(), cx.end(), cy.begin())))
+	return false;
+    }
+  }
+  return true;
+}
+
+static void emit(ostream& out, const string& config, const string& phase,
+		 int arch, double secs, unsigned long ndocs,
+		 const string& extra = ""){
+  out << "{" << config << ", \"phase\": \"" << phase << "\"";
+  if (arch >= 0) out << ", \"arch\": " << arch;
+  out << ", \"ndocs\": " << ndocs << ", \"seconds\": " << secs
+      << ", \"us_per_doc\": " << (ndocs > 0 ? 1e6 * secs / ndocs : 0.0)
+      << extra << "}" << endl;
+}
+
+int main(int argc, char** argv) {
+  dynet::initialize(argc, argv);
+
+  // argument parsing
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "produce this help information")
+    ("tag", po::value<string>()->default_value(string("")), "label of this run, e.g. the build")
+    ("ndocs", po::value<unsigned>()->default_value((unsigned)2000), "number of synthetic docs")
+    ("nedus", po::value<unsigned>()->default_value((unsigned)20), "max number of EDUs per doc")
+    ("edulen", po::value<unsigned>()->default_value((unsigned)15), "max number of tokens per EDU")
+    ("depth", po::value<unsigned>()->default_value((unsigned)6), "max depth of discourse trees")
+    ("branch", po::value<unsigned>()->default_value((unsigned)4), "max number of children of an EDU")
+    ("vocab", po::value<unsigned>()->default_value((unsigned)10000), "number of word types")
+    ("archs", po::value<string>()->default_value(string("0,1,3,4")), "model architectures to time")
+    ("nclass", po::value<unsigned>()->default_value((unsigned)5), "number of doc classes")
+    ("ndisrela", po::value<unsigned>()->default_value((unsigned)36), "number of discourse relations")
+    ("inputdim", po::value<unsigned>()->default_value((unsigned)32), "input dimension")
+    ("hiddendim", po::value<unsigned>()->default_value((unsigned)32), "hidden dimension")
+    ("nlayer", po::value<unsigned>()->default_value((unsigned)1), "number of hidden layers")
+    ("batchsize", po::value<unsigned>()->default_value((unsigned)1), "number of docs per graph")
+    ("trainer", po::value<unsigned>()->default_value((unsigned)0), "training method, as in dtc")
+    ("sparse", po::value<bool>()->default_value((bool)false), "update only the looked-up rows of the lookup parameters")
+    ("nreader", po::value<unsigned>()->default_value((unsigned)0), "number of threads for reading (0: all cores)")
+    ("seed", po::value<unsigned>()->default_value((unsigned)1), "seed of the generator")
+    ("path", po::value<string>()->default_value(string("tmp")), "path for the synthetic corpus")
+    ("output", po::value<string>()->default_value(string("")), "result file (stdout if empty)");
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {cerr << desc << endl; return 1;}
+
+  GenOptions gen;
+  gen.ndocs = vm["ndocs"].as<unsigned>();
+  gen.nedus = vm["nedus"].as<unsigned>();
+  gen.edulen = vm["edulen"].as<unsigned>();
+  gen.depth = vm["depth"].as<unsigned>();
+  gen.branch = vm["branch"].as<unsigned>();
+  gen.vocab = vm["vocab"].as<unsigned>();
+  gen.nclass = vm["nclass"].as<unsigned>();
+  gen.ndisrela = vm["ndisrela"].as<unsigned>();
+  string tag = vm["tag"].as<string>();
+  unsigned inputdim = vm["inputdim"].as<unsigned>();
+  unsigned hiddendim = vm["hiddendim"].as<unsigned>();
+  unsigned nlayer = vm["nlayer"].as<unsigned>();
+  unsigned batchsize = vm["batchsize"].as<unsigned>();
+  unsigned trainer = vm["trainer"].as<unsigned>();
+  bool b_sparse = vm["sparse"].as<bool>();
+  unsigned nreader = vm["nreader"].as<unsigned>();
+  unsigned seed = vm["seed"].as<unsigned>();
+  string path = vm["path"].as<string>();
+  string foutput = vm["output"].as<string>();
+  vector<unsigned> archs;
+  vector<string> items;
+  string sarchs = vm["archs"].as<string>();
+  boost::split(items, sarchs, boost::is_any_of(","));
+  for (auto& item : items){
+    if (item.size() > 0) archs.push_back(stoul(item));
+  }
+  if ((gen.ndocs == 0) or (gen.vocab == 0) or (gen.nclass == 0)
+      or (gen.ndisrela == 0) or (batchsize == 0)){
+    cerr << "ndocs, vocab, nclass, ndisrela and batchsize should be at least 1" << endl;
+    return 2;
+  }
+  if (trainer > 2){
+    cerr << "Unrecognized trainer " << trainer << endl;
+    return 2;
+  }
+  boost::filesystem::path dir(path);
+  if (!(boost::filesystem::exists(dir))) boost::filesystem::create_directory(dir);
+  ofstream fout;
+  if (foutput.size() > 0) fout.open(foutput, ios::app);
+  ostream& out = (foutput.size() > 0) ? fout : cout;
+  // fields shared by all result lines
+  ostringstream os;
+  os << "\"tag\": \"" << tag << "\", \"nedus\": " << gen.nedus << ", \"edulen\": " << gen.edulen
+     << ", \"depth\": " << gen.depth << ", \"branch\": " << gen.branch
+     << ", \"vocab\": " << gen.vocab << ", \"inputdim\": " << inputdim
+     << ", \"hiddendim\": " << hiddendim << ", \"nlayer\": " << nlayer
+     << ", \"batchsize\": " << batchsize << ", \"trainer\": " << trainer
+     << ", \"sparse\": " << (b_sparse ? "true" : "false");
+  string config = os.str();
+
+  // generate
+  mt19937 rng(seed);
+  string fcorpus = path + "/bench-corpus.txt";
+  Clock::time_point t0 = Clock::now();
+  generate_corpus(fcorpus, gen, rng);
+  emit(out, config, "generate", -1, seconds(t0, Clock::now()), gen.ndocs);
+
+  // load
+  t0 = Clock::now();
+  Corpus corpus = read_corpus((char*)fcorpus.c_str(), &d, true, 1);
+  emit(out, config, "read_corpus", -1, seconds(t0, Clock::now()), corpus.size());
+  int status = 0;
+  {
+    dynet::Dict dp;
+    t0 = Clock::now();
+    Corpus pcorpus = read_corpus((char*)fcorpus.c_str(), &dp, true, nreader);
+    emit(out, config, "read_corpus_parallel", -1, seconds(t0, Clock::now()), pcorpus.size());
+    if ((dp.size() != d.size()) or (!same_corpus(corpus, pcorpus))){
+      cerr << "The parallel reader differs from the serial one" << endl;
+      status = 3;
+    }
+  }
+  d.freeze();
+  unsigned long n_edus = 0;
+  t0 = Clock::now();
+  for (auto& doc : corpus) n_edus += topological_sorting(doc).size();
+  emit(out, config, "topological_sorting", -1, seconds(t0, Clock::now()), corpus.size());
+  cerr << "Corpus: " << corpus.size() << " docs, " << n_edus << " EDUs" << endl;
+
+  // train and test steps of each arch, one graph per batch;
+  // the native engine is checked against the test graphs
+  for (auto arch : archs){
+    Model model;
+    TextClass<LSTMBuilder> tc(model, inputdim, hiddendim, nlayer,
+			      gen.nclass, gen.ndisrela, d.size(),
+			      d, nullptr, arch);
+    TrainerParams tparams;
+    unique_ptr<Trainer> sgd(new_trainer(model, trainer, (trainer == 2) ? 0.001 : 0.1, tparams));
+    unique_ptr<SparseUpdater> sparse;
+    if (b_sparse) sparse.reset(new SparseUpdater(model, sgd.get(), trainer, tparams));
+    double t_build = 0, t_forward = 0, t_backward = 0, t_update = 0, t_test = 0;
+    vector<vector<float>> gprobs;
+    for (unsigned i = 0; i < corpus.size(); i += batchsize){
+      vector<const Doc*> docs;
+      for (unsigned j = i; j < min((unsigned)corpus.size(), i + batchsize); j++)
+	docs.push_back(&corpus[j]);
+      Clock::time_point t1 = Clock::now();
+      ComputationGraph cg;
+      vector<Expression> losses = tc.build_model(docs, cg, 0.0, false);
+      Expression loss_expr = sum(losses);
+      Clock::time_point t2 = Clock::now();
+      cg.forward(loss_expr);
+      Clock::time_point t3 = Clock::now();
+      cg.backward(loss_expr);
+      Clock::time_point t4 = Clock::now();
+      if (sparse) sparse->update();
+      else sgd->update();
+      Clock::time_point t5 = Clock::now();
+      t_build += seconds(t1, t2);
+      t_forward += seconds(t2, t3);
+      t_backward += seconds(t3, t4);
+      t_update += seconds(t4, t5);
+    }
+    for (unsigned i = 0; i < corpus.size(); i += batchsize){
+      vector<const Doc*> docs;
+      for (unsigned j = i; j < min((unsigned)corpus.size(), i + batchsize); j++)
+	docs.push_back(&corpus[j]);
+      Clock::time_point t1 = Clock::now();
+      ComputationGraph cg;
+      vector<Expression> probs = tc.build_model(docs, cg, 0.0, true);
+      cg.forward(probs.back());
+      t_test += seconds(t1, Clock::now());
+      for (auto& prob : probs) gprobs.push_back(as_vector(prob.value()));
+    }
+    InferEngine engine(tc.infer_source());
+    vector<vector<float>> nprobs(corpus.size());
+    Clock::time_point t1 = Clock::now();
+    for (unsigned i = 0; i < corpus.size(); i++) engine.predict(corpus[i], nprobs[i]);
+    double t_native = seconds(t1, Clock::now());
+    float max_diff = 0;
+    for (unsigned i = 0; i < corpus.size(); i++){
+      for (unsigned c = 0; c < gprobs[i].size(); c++)
+	max_diff = max(max_diff, fabs(gprobs[i][c] - nprobs[i][c]));
+    }
+    if (max_diff > 1e-4){
+      cerr << "Native inference of arch " << arch << " differs from the graph by "
+	   << max_diff << endl;
+      status = 3;
+    }
+    emit(out, config, "build_model", arch, t_build, corpus.size());
+    emit(out, config, "forward", arch, t_forward, corpus.size());
+    emit(out, config, "backward", arch, t_backward, corpus.size());
+    emit(out, config, "update", arch, t_update, corpus.size());
+    emit(out, config, "test", arch, t_test, corpus.size());
+    ostringstream extra;
+    extra << ", \"kernels\": \"" << InferEngine::kernels() << "\", \"max_diff\": " << max_diff;
+    emit(out, config, "test_native", arch, t_native, corpus.size(), extra.str());
+  }
+  return status;
+}
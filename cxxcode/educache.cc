@@ -0,0 +1,191 @@
+// educache.cc
+// Date: Oct. 17, 2026
+
+#include "educache.h"
+#include "parallel.h"
+
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+
+#include <pthread.h>
+
+struct EduCache::Header{
+  pthread_mutex_t lock; // shared between processes
+  unsigned count; // entries in use
+  int32_t head, tail; // most / least recently used
+  uint64_t hits, misses;
+};
+
+struct EduCache::Entry{
+  uint64_t hash;
+  uint32_t len;
+  int32_t prev, next; // LRU list
+  int32_t chain; // next entry in the same bucket
+};
+
+// FNV-1a hash of the token ids
+static uint64_t hash_edu(EduView edu){
+  uint64_t h = 14695981039346656037ULL;
+  for (auto tok : edu){
+    uint32_t v = (uint32_t)tok;
+    for (unsigned b = 0; b < 4; b++){
+      h ^= (v >> (8 * b)) & 0xff; h *= 1099511628211ULL;
+    }
+  }
+  return h;
+}
+
+EduCache::EduCache(unsigned capacity, unsigned dim, unsigned maxlen):
+  capacity(capacity), rep_dim(dim), maxlen(maxlen){
+  if (capacity == 0){
+    cerr << "EDU cache needs at least one entry" << endl;
+    exit(1);
+  }
+  nbuckets = capacity * 2;
+  nbytes = sizeof(Header) + capacity * sizeof(Entry)
+    + nbuckets * sizeof(int32_t) + (size_t)capacity * maxlen * sizeof(int32_t)
+    + (size_t)capacity * dim * sizeof(float);
+  char* base = (char*)shared_alloc(nbytes);
+  header = (Header*)base;
+  entries = (Entry*)(base + sizeof(Header));
+  buckets = (int32_t*)(entries + capacity);
+  tokens = buckets + nbuckets;
+  values = (float*)(tokens + (size_t)capacity * maxlen);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  // a worker may be killed while it holds the lock
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&header->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  header->hits = header->misses = 0;
+  clear();
+}
+
+EduCache::~EduCache(){
+  pthread_mutex_destroy(&header->lock);
+  shared_free(header, nbytes);
+}
+
+void EduCache::clear(){
+  header->count = 0;
+  header->head = header->tail = -1;
+  for (unsigned i = 0; i < nbuckets; i++) buckets[i] = -1;
+}
+
+void EduCache::lock(){
+  int r = pthread_mutex_lock(&header->lock);
+  if (r == EOWNERDEAD){
+    // the holder died, maybe halfway through linking or
+    // filling an entry; any entry may be wrong, so all of
+    // them are dropped
+    cerr << "A worker died holding the EDU cache, emptying it" << endl;
+    clear();
+    pthread_mutex_consistent(&header->lock);
+  } else if (r != 0){
+    cerr << "Cannot lock the EDU cache: " << strerror(r) << endl;
+    exit(1);
+  }
+}
+
+int EduCache::find(uint64_t hash, EduView edu){
+  for (int idx = buckets[hash % nbuckets]; idx >= 0; idx = entries[idx].chain){
+    const Entry& e = entries[idx];
+    if ((e.hash == hash) and (e.len == edu.size())
+	and (memcmp(tokens + (size_t)idx * maxlen, edu.begin(),
+		    edu.size() * sizeof(int)) == 0))
+      return idx;
+  }
+  return -1;
+}
+
+void EduCache::unlink_lru(int idx){
+  Entry& e = entries[idx];
+  if (e.prev >= 0) entries[e.prev].next = e.next; else header->head = e.next;
+  if (e.next >= 0) entries[e.next].prev = e.prev; else header->tail = e.prev;
+  e.prev = e.next = -1;
+}
+
+void EduCache::push_front(int idx){
+  Entry& e = entries[idx];
+  e.prev = -1;
+  e.next = header->head;
+  if (header->head >= 0) entries[header->head].prev = idx;
+  header->head = idx;
+  if (header->tail < 0) header->tail = idx;
+}
+
+void EduCache::unlink_bucket(int idx){
+  int32_t* link = &buckets[entries[idx].hash % nbuckets];
+  while (*link != idx) link = &entries[*link].chain;
+  *link = entries[idx].chain;
+}
+
+bool EduCache::get(EduView edu, vector<float>& value){
+  if (edu.size() > maxlen){
+    // too long to be kept
+    lock();
+    header->misses ++;
+    pthread_mutex_unlock(&header->lock);
+    return false;
+  }
+  uint64_t hash = hash_edu(edu);
+  lock();
+  int idx = find(hash, edu);
+  if (idx >= 0){
+    unlink_lru(idx);
+    push_front(idx);
+    const float* v = values + (size_t)idx * rep_dim;
+    value.assign(v, v + rep_dim);
+    header->hits ++;
+  } else {
+    header->misses ++;
+  }
+  pthread_mutex_unlock(&header->lock);
+  return (idx >= 0);
+}
+
+void EduCache::put(EduView edu, const vector<float>& value){
+  if (value.size() != rep_dim){
+    cerr << "Wrong dimension of an EDU rep: " << value.size()
+	 << ", expected " << rep_dim << endl;
+    exit(1);
+  }
+  if (edu.size() > maxlen) return;
+  uint64_t hash = hash_edu(edu);
+  lock();
+  int idx = find(hash, edu);
+  if (idx >= 0){
+    unlink_lru(idx);
+  } else {
+    if (header->count < capacity){
+      idx = header->count ++;
+    } else {
+      // evict the least recently used one
+      idx = header->tail;
+      unlink_lru(idx);
+      unlink_bucket(idx);
+    }
+    Entry& e = entries[idx];
+    e.hash = hash; e.len = edu.size();
+    memcpy(tokens + (size_t)idx * maxlen, edu.begin(), edu.size() * sizeof(int));
+    e.chain = buckets[hash % nbuckets];
+    buckets[hash % nbuckets] = idx;
+  }
+  push_front(idx);
+  memcpy(values + (size_t)idx * rep_dim, value.data(), rep_dim * sizeof(float));
+  pthread_mutex_unlock(&header->lock);
+}
+
+unsigned long EduCache::hits() const{
+  return header->hits;
+}
+
+unsigned long EduCache::misses() const{
+  return header->misses;
+}
+
+unsigned EduCache::size() const{
+  return header->count;
+}
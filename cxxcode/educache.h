@@ -0,0 +1,57 @@
+// educache.h
+// Date: Oct. 17, 2026
+
+#ifndef EDUCACHE_H
+#define EDUCACHE_H
+
+#include "util.h"
+
+#include <cstdint>
+
+using namespace std;
+
+// *******************************************************
+// EDU cache
+//
+// Maps the token ids of an EDU to its sentence rep, for
+// inference only. The table lives in shared memory, so the
+// evaluation workers forked after it is created all read
+// and fill the same entries. An entry keeps the ids of its
+// EDU, at most maxlen of them, and a hit must match them
+// all; longer EDUs are not cached. The least recently used
+// entry is evicted when the cache is full
+// *******************************************************
+class EduCache{
+public:
+  EduCache(unsigned capacity, unsigned dim, unsigned maxlen = 64);
+  ~EduCache();
+  // copy the rep of edu into value, false if not cached
+  bool get(EduView edu, vector<float>& value);
+  void put(EduView edu, const vector<float>& value);
+  unsigned long hits() const;
+  unsigned long misses() const;
+  unsigned size() const;
+  unsigned dim() const { return rep_dim; }
+
+private:
+  struct Header;
+  struct Entry;
+  void clear();
+  void lock();
+  int find(uint64_t hash, EduView edu);
+  void unlink_lru(int idx);
+  void push_front(int idx);
+  void unlink_bucket(int idx);
+  unsigned capacity;
+  unsigned rep_dim;
+  unsigned maxlen; // token ids kept per entry
+  unsigned nbuckets;
+  size_t nbytes;
+  Header* header;
+  Entry* entries;
+  int32_t* buckets;
+  int32_t* tokens; // maxlen ids per entry
+  float* values;
+};
+
+#endif
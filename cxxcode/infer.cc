@@ -0,0 +1,633 @@
+// infer.cc
+// Date: Oct. 17, 2026
+
+#include "infer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INFER_X86 1
+#endif
+
+// *******************************************************
+// kernels
+//
+// gemv: y = W x, or y += W x with b_acc
+// gemv_q8: the same with an int8 W
+// dot: a . b
+// axpy: y += a x
+// *******************************************************
+static void gemv_scalar(const InferMatrix& W, const float* x, float* y, bool b_acc){
+  for (unsigned r = 0; r < W.rows; r++){
+    const float* w = W.row(r);
+    float s = 0;
+    for (unsigned c = 0; c < W.cols; c++) s += w[c] * x[c];
+    y[r] = b_acc ? y[r] + s : s;
+  }
+}
+
+static void gemv_q8_scalar(const InferMatrix& W, const float* x, float* y, bool b_acc){
+  for (unsigned r = 0; r < W.rows; r++){
+    const int8_t* w = W.qrow(r);
+    float s = 0;
+    for (unsigned c = 0; c < W.cols; c++) s += w[c] * x[c];
+    s *= W.scale[r];
+    y[r] = b_acc ? y[r] + s : s;
+  }
+}
+
+static float dot_scalar(const float* a, const float* b, unsigned n){
+  float s = 0;
+  for (unsigned i = 0; i < n; i++) s += a[i] * b[i];
+  return s;
+}
+
+static void axpy_scalar(float a, const float* x, float* y, unsigned n){
+  for (unsigned i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+#ifdef INFER_X86
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx2(__m256 v){
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+// four rows at a time, so each load of x is used four times
+__attribute__((target("avx2,fma")))
+static void gemv_avx2(const InferMatrix& W, const float* x, float* y, bool b_acc){
+  unsigned n = W.cols, n8 = n / 8 * 8, r = 0;
+  for (; r + 4 <= W.rows; r += 4){
+    const float* w0 = W.row(r);
+    const float* w1 = w0 + n;
+    const float* w2 = w1 + n;
+    const float* w3 = w2 + n;
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    for (unsigned c = 0; c < n8; c += 8){
+      __m256 xv = _mm256_loadu_ps(x + c);
+      s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0 + c), xv, s0);
+      s1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + c), xv, s1);
+      s2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2 + c), xv, s2);
+      s3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3 + c), xv, s3);
+    }
+    float t[4] = {hsum_avx2(s0), hsum_avx2(s1), hsum_avx2(s2), hsum_avx2(s3)};
+    for (unsigned c = n8; c < n; c++){
+      t[0] += w0[c] * x[c]; t[1] += w1[c] * x[c];
+      t[2] += w2[c] * x[c]; t[3] += w3[c] * x[c];
+    }
+    for (unsigned i = 0; i < 4; i++) y[r+i] = b_acc ? y[r+i] + t[i] : t[i];
+  }
+  for (; r < W.rows; r++){
+    const float* w = W.row(r);
+    __m256 s = _mm256_setzero_ps();
+    for (unsigned c = 0; c < n8; c += 8)
+      s = _mm256_fmadd_ps(_mm256_loadu_ps(w + c), _mm256_loadu_ps(x + c), s);
+    float t = hsum_avx2(s);
+    for (unsigned c = n8; c < n; c++) t += w[c] * x[c];
+    y[r] = b_acc ? y[r] + t : t;
+  }
+}
+
+// eight int8 weights as floats
+__attribute__((target("avx2,fma")))
+static inline __m256 load_q8_avx2(const int8_t* q){
+  __m128i b = _mm_loadl_epi64((const __m128i*)q);
+  return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(b));
+}
+
+__attribute__((target("avx2,fma")))
+static void gemv_q8_avx2(const InferMatrix& W, const float* x, float* y, bool b_acc){
+  unsigned n = W.cols, n8 = n / 8 * 8, r = 0;
+  for (; r + 4 <= W.rows; r += 4){
+    const int8_t* w0 = W.qrow(r);
+    const int8_t* w1 = w0 + n;
+    const int8_t* w2 = w1 + n;
+    const int8_t* w3 = w2 + n;
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    for (unsigned c = 0; c < n8; c += 8){
+      __m256 xv = _mm256_loadu_ps(x + c);
+      s0 = _mm256_fmadd_ps(load_q8_avx2(w0 + c), xv, s0);
+      s1 = _mm256_fmadd_ps(load_q8_avx2(w1 + c), xv, s1);
+      s2 = _mm256_fmadd_ps(load_q8_avx2(w2 + c), xv, s2);
+      s3 = _mm256_fmadd_ps(load_q8_avx2(w3 + c), xv, s3);
+    }
+    float t[4] = {hsum_avx2(s0), hsum_avx2(s1), hsum_avx2(s2), hsum_avx2(s3)};
+    for (unsigned c = n8; c < n; c++){
+      t[0] += w0[c] * x[c]; t[1] += w1[c] * x[c];
+      t[2] += w2[c] * x[c]; t[3] += w3[c] * x[c];
+    }
+    for (unsigned i = 0; i < 4; i++){
+      t[i] *= W.scale[r+i];
+      y[r+i] = b_acc ? y[r+i] + t[i] : t[i];
+    }
+  }
+  for (; r < W.rows; r++){
+    const int8_t* w = W.qrow(r);
+    __m256 s = _mm256_setzero_ps();
+    for (unsigned c = 0; c < n8; c += 8)
+      s = _mm256_fmadd_ps(load_q8_avx2(w + c), _mm256_loadu_ps(x + c), s);
+    float t = hsum_avx2(s);
+    for (unsigned c = n8; c < n; c++) t += w[c] * x[c];
+    t *= W.scale[r];
+    y[r] = b_acc ? y[r] + t : t;
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float* a, const float* b, unsigned n){
+  unsigned n8 = n / 8 * 8;
+  __m256 s = _mm256_setzero_ps();
+  for (unsigned i = 0; i < n8; i += 8)
+    s = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s);
+  float t = hsum_avx2(s);
+  for (unsigned i = n8; i < n; i++) t += a[i] * b[i];
+  return t;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(float a, const float* x, float* y, unsigned n){
+  unsigned n8 = n / 8 * 8;
+  __m256 av = _mm256_set1_ps(a);
+  for (unsigned i = 0; i < n8; i += 8)
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(av, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+  for (unsigned i = n8; i < n; i++) y[i] += a * x[i];
+}
+#endif
+
+struct Kernels{
+  void (*gemv)(const InferMatrix&, const float*, float*, bool);
+  void (*gemv_q8)(const InferMatrix&, const float*, float*, bool);
+  float (*dot)(const float*, const float*, unsigned);
+  void (*axpy)(float, const float*, float*, unsigned);
+  const char* name;
+};
+
+// picked once, from what the CPU running the binary has;
+// DTC_SCALAR=1 forces the plain loops
+static Kernels pick_kernels(){
+#ifdef INFER_X86
+  const char* env = getenv("DTC_SCALAR");
+  bool b_scalar = (env != nullptr) and (strcmp(env, "1") == 0);
+  __builtin_cpu_init();
+  if ((!b_scalar) and __builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma"))
+    return Kernels{gemv_avx2, gemv_q8_avx2, dot_avx2, axpy_avx2, "avx2"};
+#endif
+  return Kernels{gemv_scalar, gemv_q8_scalar, dot_scalar, axpy_scalar, "scalar"};
+}
+
+static const Kernels K = pick_kernels();
+
+static inline void gemv(const InferMatrix& W, const float* x, float* y, bool b_acc){
+  if (W.quantized()) K.gemv_q8(W, x, y, b_acc);
+  else K.gemv(W, x, y, b_acc);
+}
+
+const char* InferEngine::kernels(){
+  return K.name;
+}
+
+static inline float sigmoid(float x){
+  return 1.f / (1.f + exp(-x));
+}
+
+// *******************************************************
+// parameters
+// *******************************************************
+
+// symmetric, with the largest magnitude of a row at 127
+void InferMatrix::quantize(){
+  if (quantized() or (rows == 0)) return;
+  q.resize((size_t)rows * cols);
+  scale.resize(rows);
+  for (unsigned r = 0; r < rows; r++){
+    const float* w = row(r);
+    float m = 0;
+    for (unsigned c = 0; c < cols; c++) m = max(m, fabs(w[c]));
+    scale[r] = (m > 0) ? m / 127 : 1;
+    int8_t* qr = q.data() + (size_t)r * cols;
+    for (unsigned c = 0; c < cols; c++)
+      qr[c] = (int8_t)lrintf(max(-127.f, min(127.f, w[c] / scale[r])));
+  }
+  vector<float>().swap(v);
+}
+
+size_t InferMatrix::n_bytes() const{
+  return v.size() * sizeof(float) + q.size() + scale.size() * sizeof(float);
+}
+
+// a DyNet matrix (column-major), or its transpose
+static InferMatrix from_dynet(const float* v, unsigned rows, unsigned cols,
+			      bool b_transpose = false){
+  InferMatrix m;
+  m.rows = b_transpose ? cols : rows;
+  m.cols = b_transpose ? rows : cols;
+  m.v.resize((size_t)rows * cols);
+  for (unsigned r = 0; r < rows; r++){
+    for (unsigned c = 0; c < cols; c++){
+      float x = v[r + (size_t)c * rows];
+      if (b_transpose) m.v[(size_t)c * rows + r] = x;
+      else m.v[(size_t)r * cols + c] = x;
+    }
+  }
+  return m;
+}
+
+static InferMatrix from_dynet(const ParameterStorage* p, bool b_transpose = false){
+  return from_dynet(p->values.v, p->dim.rows(), p->dim.cols(), b_transpose);
+}
+
+// stack matrices with the same number of columns
+static InferMatrix stack(const vector<InferMatrix>& ms){
+  InferMatrix m;
+  m.cols = ms[0].cols;
+  for (auto& part : ms){
+    m.rows += part.rows;
+    m.v.insert(m.v.end(), part.v.begin(), part.v.end());
+  }
+  return m;
+}
+
+enum {X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC};
+
+InferEngine::InferEngine(const InferSource& src):
+  arch(src.arch), edu_cache(nullptr){
+  if ((src.fw.size() == 0) or (src.fw.size() != src.bw.size())){
+    cerr << "Native inference needs the same number of LSTM layers in both directions" << endl;
+    exit(1);
+  }
+  input_dim = src.input_dim;
+  vocab_size = src.vocab_size;
+  emb = src.emb;
+  hidden_dim = src.fw[0][BI]->dim.rows();
+  rep_dim = 2 * hidden_dim;
+  nclass = src.Uc->dim.rows();
+  // gates stacked as (input, cell, output)
+  for (unsigned dir = 0; dir < 2; dir++){
+    const vector<vector<ParameterStorage*>>& layers = (dir == 0) ? src.fw : src.bw;
+    vector<LstmLayer>& lstm = (dir == 0) ? fw : bw;
+    for (auto& p : layers){
+      if (p.size() != 11){
+	cerr << "Native inference only supports the LSTM builder" << endl;
+	exit(1);
+      }
+      LstmLayer layer;
+      layer.Wx = stack({from_dynet(p[X2I]), from_dynet(p[X2C]), from_dynet(p[X2O])});
+      layer.Wh = stack({from_dynet(p[H2I]), from_dynet(p[H2C]), from_dynet(p[H2O])});
+      layer.Wci = from_dynet(p[C2I]);
+      layer.Wco = from_dynet(p[C2O]);
+      for (auto k : {BI, BC, BO})
+	layer.b.insert(layer.b.end(), p[k]->values.v, p[k]->values.v + hidden_dim);
+      lstm.push_back(layer);
+    }
+  }
+  Ua = from_dynet(src.Ua);
+  UaT = from_dynet(src.Ua, true);
+  Uc = from_dynet(src.Uc);
+  bias.assign(src.bias->values.v, src.bias->values.v + nclass);
+  for (unsigned r = 0; r < src.Ut->values.size(); r++)
+    Ut.push_back(from_dynet(src.Ut->values[r].v, rep_dim, rep_dim));
+}
+
+// *******************************************************
+// int8 weights
+//
+// The word embeddings and the LSTM matrices hold nearly all
+// the weights of a model, so only they are quantized; the
+// attention, composition and output matrices stay in floats
+// *******************************************************
+void InferEngine::quantize(){
+  if (quantized()) return;
+  E.rows = vocab_size;
+  E.cols = input_dim;
+  E.v.assign(emb, emb + (size_t)vocab_size * input_dim);
+  E.quantize();
+  emb = nullptr;
+  for (auto lstm : {&fw, &bw}){
+    for (auto& layer : *lstm){
+      layer.Wx.quantize();
+      layer.Wh.quantize();
+      layer.Wci.quantize();
+      layer.Wco.quantize();
+    }
+  }
+}
+
+size_t InferEngine::n_bytes() const{
+  size_t n = E.n_bytes() + Ua.n_bytes() + UaT.n_bytes() + Uc.n_bytes()
+    + bias.size() * sizeof(float);
+  if (emb != nullptr) n += (size_t)vocab_size * input_dim * sizeof(float);
+  for (auto& m : Ut) n += m.n_bytes();
+  for (auto lstm : {&fw, &bw}){
+    for (auto& layer : *lstm)
+      n += layer.Wx.n_bytes() + layer.Wh.n_bytes() + layer.Wci.n_bytes()
+	+ layer.Wco.n_bytes() + layer.b.size() * sizeof(float);
+  }
+  return n;
+}
+
+struct QModelHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t arch;
+  uint32_t input_dim;
+  uint32_t hidden_dim;
+  uint32_t nclass;
+  uint32_t nlayer;
+  uint32_t vocab_size;
+  uint32_t nrela;
+  uint64_t dict_hash; // fingerprint of the dict used for the ids
+};
+
+template <class T>
+static void write_vector(ofstream& out, const vector<T>& vec){
+  uint64_t n = vec.size();
+  out.write((const char*)&n, sizeof(n));
+  if (n > 0) out.write((const char*)vec.data(), n * sizeof(T));
+}
+
+template <class T>
+static bool read_vector(ifstream& in, vector<T>& vec, uint64_t n){
+  uint64_t m = 0;
+  in.read((char*)&m, sizeof(m));
+  if ((!in.good()) or (m != n)) return false;
+  vec.resize(n);
+  if (n > 0) in.read((char*)vec.data(), n * sizeof(T));
+  return in.good();
+}
+
+static void write_matrix(ofstream& out, const InferMatrix& W){
+  uint32_t dims[3] = {W.rows, W.cols, W.quantized()};
+  out.write((const char*)dims, sizeof(dims));
+  if (W.quantized()){
+    write_vector(out, W.q);
+    write_vector(out, W.scale);
+  } else {
+    write_vector(out, W.v);
+  }
+}
+
+// false if the matrix is not rows x cols or the file ends
+static bool read_matrix(ifstream& in, InferMatrix& W, unsigned rows, unsigned cols){
+  uint32_t dims[3] = {0, 0, 0};
+  in.read((char*)dims, sizeof(dims));
+  if ((!in.good()) or (dims[0] != rows) or (dims[1] != cols)) return false;
+  W.rows = rows;
+  W.cols = cols;
+  size_t n = (size_t)rows * cols;
+  if (dims[2]) return read_vector(in, W.q, n) and read_vector(in, W.scale, rows);
+  return read_vector(in, W.v, n);
+}
+
+int InferEngine::save(const string& fname, dynet::Dict& d) const{
+  QModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QMODEL_MAGIC, 8);
+  header.version = QMODEL_VERSION;
+  header.arch = arch;
+  header.input_dim = input_dim;
+  header.hidden_dim = hidden_dim;
+  header.nclass = nclass;
+  header.nlayer = fw.size();
+  header.vocab_size = vocab_size;
+  header.nrela = Ut.size();
+  header.dict_hash = dict_fingerprint(d);
+  if (!quantized()){
+    cerr << "Only a quantized engine can be saved" << endl;
+    return 1;
+  }
+  ofstream out(fname, ios::binary);
+  if (!out.good()){
+    cerr << "Cannot write quantized model to " << fname << endl;
+    return 1;
+  }
+  out.write((const char*)&header, sizeof(header));
+  write_matrix(out, E);
+  for (auto lstm : {&fw, &bw}){
+    for (auto& layer : *lstm){
+      write_matrix(out, layer.Wx);
+      write_matrix(out, layer.Wh);
+      write_matrix(out, layer.Wci);
+      write_matrix(out, layer.Wco);
+      write_vector(out, layer.b);
+    }
+  }
+  write_matrix(out, Ua);
+  write_matrix(out, Uc);
+  write_vector(out, bias);
+  for (auto& m : Ut) write_matrix(out, m);
+  out.close();
+  if (!out.good()){
+    cerr << "Cannot write quantized model to " << fname << endl;
+    return 1;
+  }
+  return 0;
+}
+
+InferEngine* InferEngine::load(const string& fname, dynet::Dict& d){
+  ifstream in(fname, ios::binary);
+  QModelHeader header;
+  in.read((char*)&header, sizeof(header));
+  if ((!in.good()) or (memcmp(header.magic, QMODEL_MAGIC, 8) != 0)){
+    cerr << fname << " is not a quantized model" << endl;
+    exit(1);
+  }
+  if (header.version != QMODEL_VERSION){
+    cerr << "Quantized model " << fname << " has version " << header.version
+	 << ", expected " << QMODEL_VERSION << endl;
+    exit(1);
+  }
+  if ((header.vocab_size != d.size()) or (header.dict_hash != dict_fingerprint(d))){
+    cerr << "Quantized model " << fname
+	 << " was built with a different dict" << endl;
+    exit(1);
+  }
+  unique_ptr<InferEngine> engine(new InferEngine());
+  InferEngine& e = *engine;
+  e.arch = header.arch;
+  e.input_dim = header.input_dim;
+  e.hidden_dim = header.hidden_dim;
+  e.rep_dim = 2 * e.hidden_dim;
+  e.nclass = header.nclass;
+  e.vocab_size = header.vocab_size;
+  unsigned H = e.hidden_dim, R = e.rep_dim;
+  bool b_ok = read_matrix(in, e.E, e.vocab_size, e.input_dim);
+  for (auto lstm : {&e.fw, &e.bw}){
+    lstm->resize(header.nlayer);
+    for (unsigned l = 0; b_ok and (l < header.nlayer); l++){
+      LstmLayer& layer = (*lstm)[l];
+      b_ok = read_matrix(in, layer.Wx, 3 * H, (l == 0) ? e.input_dim : H)
+	and read_matrix(in, layer.Wh, 3 * H, H)
+	and read_matrix(in, layer.Wci, H, H)
+	and read_matrix(in, layer.Wco, H, H)
+	and read_vector(in, layer.b, 3 * H);
+    }
+  }
+  b_ok = b_ok and read_matrix(in, e.Ua, R, R)
+    and read_matrix(in, e.Uc, e.nclass, R)
+    and read_vector(in, e.bias, e.nclass);
+  e.Ut.resize(header.nrela);
+  for (unsigned r = 0; b_ok and (r < header.nrela); r++)
+    b_ok = read_matrix(in, e.Ut[r], R, R);
+  if ((!b_ok) or (!e.E.quantized())){
+    cerr << "Truncated quantized model: " << fname << endl;
+    exit(1);
+  }
+  // Ua^T is not stored
+  e.UaT.rows = R;
+  e.UaT.cols = R;
+  e.UaT.v.resize((size_t)R * R);
+  for (unsigned r = 0; r < R; r++)
+    for (unsigned c = 0; c < R; c++)
+      e.UaT.v[(size_t)c * R + r] = e.Ua.v[(size_t)r * R + c];
+  return engine.release();
+}
+
+// *******************************************************
+// forward pass
+// *******************************************************
+void InferEngine::run_lstm(const vector<LstmLayer>& lstm, EduView edu,
+			   bool b_reverse, float* out){
+  unsigned T = edu.size(), H = hidden_dim;
+  if (gates.size() < (size_t)T * 3 * H) gates.resize((size_t)T * 3 * H);
+  if (hs.size() < (size_t)T * H) hs.resize((size_t)T * H);
+  cell.resize(H);
+  for (unsigned l = 0; l < lstm.size(); l++){
+    const LstmLayer& layer = lstm[l];
+    // input part of the gates for all steps
+    for (unsigned t = 0; t < T; t++){
+      const float* x;
+      if ((l == 0) and E.quantized()){
+	int w = b_reverse ? edu[T - 1 - t] : edu[t];
+	const int8_t* qw = E.qrow(w);
+	xvec.resize(input_dim);
+	for (unsigned j = 0; j < input_dim; j++) xvec[j] = E.scale[w] * qw[j];
+	x = xvec.data();
+      } else if (l == 0){
+	int w = b_reverse ? edu[T - 1 - t] : edu[t];
+	x = emb + (size_t)w * input_dim;
+      } else {
+	x = hs.data() + (size_t)t * H;
+      }
+      float* g = gates.data() + (size_t)t * 3 * H;
+      memcpy(g, layer.b.data(), 3 * H * sizeof(float));
+      gemv(layer.Wx, x, g, true);
+    }
+    // recurrence; the hidden states of the layer below are
+    // no longer needed
+    for (unsigned t = 0; t < T; t++){
+      float* g = gates.data() + (size_t)t * 3 * H;
+      float* gi = g;
+      float* gc = g + H;
+      float* go = g + 2 * H;
+      float* h = hs.data() + (size_t)t * H;
+      if (t > 0){
+	gemv(layer.Wh, h - H, g, true);
+	gemv(layer.Wci, cell.data(), gi, true);
+      }
+      for (unsigned j = 0; j < H; j++){
+	float it = sigmoid(gi[j]);
+	float wt = tanh(gc[j]);
+	cell[j] = (t > 0) ? (1.f - it) * cell[j] + it * wt : it * wt;
+      }
+      gemv(layer.Wco, cell.data(), go, true);
+      for (unsigned j = 0; j < H; j++) h[j] = sigmoid(go[j]) * tanh(cell[j]);
+    }
+  }
+  memcpy(out, hs.data() + (size_t)(T - 1) * H, H * sizeof(float));
+}
+
+void InferEngine::edu_rep(EduView edu, float* out){
+  if ((edu_cache != nullptr) and edu_cache->get(edu, value)){
+    memcpy(out, value.data(), rep_dim * sizeof(float));
+    return;
+  }
+  for (auto w : edu){
+    if ((w < 0) or ((unsigned)w >= vocab_size)){
+      cerr << "Word index " << w << " is out of the vocab" << endl;
+      exit(1);
+    }
+  }
+  run_lstm(fw, edu, false, out);
+  run_lstm(bw, edu, true, out + hidden_dim);
+  if (edu_cache != nullptr){
+    value.assign(out, out + rep_dim);
+    edu_cache->put(edu, value);
+  }
+}
+
+void InferEngine::predict(const Doc& doc, vector<float>& prob, Record* record){
+  unsigned n_edus = doc.n_edus(), R = rep_dim;
+  if (reps.size() < (size_t)n_edus * R) reps.resize((size_t)n_edus * R);
+  for (unsigned eidx = 0; eidx < n_edus; eidx++)
+    edu_rep(doc.edu(eidx), reps.data() + (size_t)eidx * R);
+  if (record != nullptr) record->clear();
+  float* root = reps.data() + (size_t)doc.root * R;
+  if (arch == 3){
+    // bag of EDUs
+    for (unsigned eidx = 0; eidx < n_edus; eidx++){
+      if ((int)eidx != doc.root) K.axpy(1.f, reps.data() + (size_t)eidx * R, root, R);
+    }
+    for (unsigned j = 0; j < R; j++) root[j] /= n_edus;
+  } else {
+    // leaves only go through tanh in arch 4
+    if ((arch == 4) and (doc.n_levels() > 0)){
+      for (auto pidx : doc.level(0)){
+	float* rep = reps.data() + (size_t)pidx * R;
+	for (unsigned j = 0; j < R; j++) rep[j] = tanh(rep[j]);
+      }
+    }
+    // children come before their pnode in the order
+    wvec.resize(R); acc.resize(R); tvec.resize(R);
+    for (auto pidx : doc.order()){
+      NodeList children = doc.children(pidx);
+      if (children.empty()) continue;
+      float* prep = reps.data() + (size_t)pidx * R;
+      // arch 0/1: p^T Ua c = (Ua^T p) . c
+      // arch 4: c^T Ua p = c . (Ua p)
+      gemv((arch == 4) ? Ua : UaT, prep, wvec.data(), false);
+      score.resize(children.size());
+      for (unsigned k = 0; k < children.size(); k++)
+	score[k] = K.dot(wvec.data(), reps.data() + (size_t)children[k] * R, R);
+      if (arch == 4){
+	float m = *max_element(score.begin(), score.end());
+	double z = 0;
+	for (auto& s : score){ s = exp(s - m); z += s; }
+	for (auto& s : score) s /= z;
+      } else {
+	for (auto& s : score) s = sigmoid(s);
+      }
+      memcpy(acc.data(), prep, R * sizeof(float));
+      for (unsigned k = 0; k < children.size(); k++){
+	int cidx = children[k];
+	const float* crep = reps.data() + (size_t)cidx * R;
+	if (arch == 0){
+	  // relation-specific composition
+	  gemv(Ut[doc.rela(cidx)], crep, tvec.data(), false);
+	  crep = tvec.data();
+	}
+	K.axpy(score[k], crep, acc.data(), R);
+	if (record != nullptr) record->push_back(make_pair((unsigned)cidx, score[k]));
+      }
+      for (unsigned j = 0; j < R; j++) prep[j] = tanh(acc[j]);
+    }
+  }
+  // softmax of Uc root + bias
+  prob.resize(nclass);
+  gemv(Uc, root, prob.data(), false);
+  float m = -INFINITY;
+  for (unsigned c = 0; c < nclass; c++){
+    prob[c] += bias[c];
+    m = max(m, prob[c]);
+  }
+  double z = 0;
+  for (auto& p : prob){ p = exp(p - m); z += p; }
+  for (auto& p : prob) p /= z;
+}
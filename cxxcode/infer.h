@@ -0,0 +1,119 @@
+// infer.h
+// Date: Oct. 17, 2026
+
+#ifndef INFER_H
+#define INFER_H
+
+#include "util.h"
+#include "educache.h"
+
+using namespace std;
+
+// *******************************************************
+// Native inference
+//
+// Scores docs with the parameters of a trained TextClass
+// (LSTM builders) without building a computation graph.
+// The weights are copied once into row-major buffers, the
+// three gates of an LSTM step share one matrix-vector
+// product, and the tree is composed pnode by pnode in the
+// topological order with scratch space reused across
+// docs. The kernels use AVX2/FMA when the CPU has them and
+// plain loops otherwise
+//
+// After quantize(), the word embeddings and the LSTM
+// matrices are kept in int8 with one scale per row, and
+// are expanded on the fly by the kernels. A quantized
+// engine is saved on its own (--task quantize) and loaded
+// without the DyNet model
+// *******************************************************
+const char QMODEL_MAGIC[8] = "DTCQMOD";
+const uint32_t QMODEL_VERSION = 1;
+
+
+// the parameters of a TextClass as DyNet stores them
+// (column-major); the word embeddings are read in place,
+// so the model, or the pretrained table, has to outlive
+// the engine
+struct InferSource{
+  unsigned arch;
+  const float* emb; // the table used by embed_words, a row per word
+  unsigned vocab_size;
+  unsigned input_dim;
+  ParameterStorage* Ua;
+  LookupParameterStorage* Ut;
+  ParameterStorage* Uc;
+  ParameterStorage* bias;
+  // the LSTM parameters of each layer, in the order of
+  // the builder: X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC
+  vector<vector<ParameterStorage*>> fw, bw;
+};
+
+// a row-major matrix, in floats or in int8 with a scale
+// per row: w[r][c] = scale[r] * q[r][c]
+struct InferMatrix{
+  unsigned rows = 0;
+  unsigned cols = 0;
+  vector<float> v;
+  vector<int8_t> q;
+  vector<float> scale;
+  const float* row(unsigned r) const {return v.data() + (size_t)r * cols;}
+  const int8_t* qrow(unsigned r) const {return q.data() + (size_t)r * cols;}
+  bool quantized() const {return !q.empty();}
+  // to int8, the floats are dropped
+  void quantize();
+  size_t n_bytes() const;
+};
+
+class InferEngine{
+public:
+  InferEngine(const InferSource& src);
+  // a quantized engine saved by save(); the dict has to be
+  // the one of the model
+  static InferEngine* load(const string& fname, dynet::Dict& d);
+  int save(const string& fname, dynet::Dict& d) const;
+  void quantize();
+  bool quantized() const { return E.quantized(); }
+  // bytes of the weights, with the word embeddings a float
+  // engine reads from the model
+  size_t n_bytes() const;
+  // class probabilities of a doc, as build_model with b_test;
+  // with record, its attention weights as read_record gives
+  void predict(const Doc& doc, vector<float>& prob, Record* record = nullptr);
+  // reuse EDU reps, as TextClass::set_edu_cache
+  void set_edu_cache(EduCache* cache) { edu_cache = cache; }
+  unsigned dim() const { return rep_dim; }
+  // "avx2" or "scalar"
+  static const char* kernels();
+
+private:
+  InferEngine(): emb(nullptr), edu_cache(nullptr) {}
+  // one LSTM layer, the gates stacked in the order
+  // (input, cell, output)
+  struct LstmLayer{
+    InferMatrix Wx; // 3H x input
+    InferMatrix Wh; // 3H x H
+    InferMatrix Wci, Wco; // peepholes, H x H
+    vector<float> b; // 3H
+  };
+  // the last hidden state of the top layer, with the tokens
+  // read from the end when b_reverse
+  void run_lstm(const vector<LstmLayer>& lstm, EduView edu,
+		bool b_reverse, float* out);
+  void edu_rep(EduView edu, float* out);
+
+  unsigned arch;
+  unsigned input_dim, hidden_dim, rep_dim, nclass;
+  const float* emb; // vocab_size x input_dim, not owned
+  InferMatrix E; // the same table once quantized
+  unsigned vocab_size;
+  vector<LstmLayer> fw, bw;
+  InferMatrix Ua, UaT, Uc;
+  vector<InferMatrix> Ut;
+  vector<float> bias;
+  EduCache* edu_cache;
+  // scratch space
+  vector<float> reps, gates, hs, cell, score, wvec, acc, tvec, value, xvec;
+};
+
+#endif
@@ -16,12 +16,22 @@
 #include "dynet/model.h"
 
 #include "textclass.h"
+#include "parallel.h"
+#include "server.h"
+#include "metrics.h"
+#include "sparse.h"
+#include "pipeline.h"
+#include "sweep.h"
 
 #include <boost/program_options.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/format.hpp>
 
+#include <unistd.h>
+#include <thread>
+#include <memory>
+
 namespace po = boost::program_options;
 
 #define _NO_DEBUG_MODE_ 1
@@ -33,6 +43,171 @@ namespace po = boost::program_options;
 INITIALIZE_EASYLOGGINGPP
 #endif
 
+// *******************************************************
+// Evaluation with forked workers
+//
+// Each worker takes a contiguous slice of the corpus and
+// sends back its predictions, class probabilities and
+// (when b_record is true) attention records, so the results
+// stay in doc order. With an engine, docs are scored by it
+// instead of a graph. With metrics, the build and forward
+// time and the graph nodes of the docs done in this process
+// are added, as in training. Return the accuracy
+// *******************************************************
+template <class Builder>
+float evaluate(TextClass<Builder>* tc, const Corpus& corpus, float droprate,
+	       unsigned nworkers, bool b_record, vector<unsigned>& plabels,
+	       vector<vector<float>>& probs, vector<Record>& records,
+	       InferEngine* engine = nullptr, Metrics* metrics = nullptr){
+  plabels.clear(); probs.clear(); records.clear();
+  if (corpus.size() == 0) return 0.0;
+  typedef chrono::steady_clock Clock;
+  auto seconds = [](Clock::time_point from, Clock::time_point to){
+    return chrono::duration<double>(to - from).count();
+  };
+  // predict the docs in [begin, end)
+  auto eval_range = [&](unsigned begin, unsigned end, vector<unsigned>& pl,
+			vector<vector<float>>& ps, vector<Record>& rs,
+			Metrics* m){
+    for (unsigned i = begin; i < end; i++){
+      if (engine != nullptr){
+	ps.push_back(vector<float>());
+	Record record;
+	Clock::time_point t0 = Clock::now();
+	engine->predict(corpus[i], ps.back(), b_record ? &record : nullptr);
+	if (m != nullptr) m->add(PH_FORWARD, seconds(t0, Clock::now()));
+	pl.push_back(distance(ps.back().begin(), max_element(ps.back().begin(), ps.back().end())));
+	if (b_record) rs.push_back(record);
+	continue;
+      }
+      ComputationGraph cg;
+      Clock::time_point t0 = Clock::now();
+      Expression loss_expr = tc->build_model(corpus[i], cg, droprate, true, b_record);
+      Clock::time_point t1 = Clock::now();
+      ps.push_back(as_vector(cg.forward(loss_expr)));
+      if (m != nullptr){
+	m->add(PH_BUILD, seconds(t0, t1));
+	m->add(PH_FORWARD, seconds(t1, Clock::now()));
+	m->count(0, 0, cg.nodes.size());
+      }
+      tc->cache_edus();
+      pl.push_back(distance(ps.back().begin(), max_element(ps.back().begin(), ps.back().end())));
+      if (b_record){
+	rs.push_back(Record());
+	tc->read_record(rs.back());
+      }
+    }
+  };
+  if (nworkers == 0) nworkers = thread::hardware_concurrency();
+  nworkers = max((unsigned)1, min(nworkers, (unsigned)corpus.size()));
+  unsigned chunk = (corpus.size() + nworkers - 1) / nworkers;
+  vector<Worker> workers;
+  for (unsigned w = 1; w < nworkers; w++){
+    unsigned begin = min(w * chunk, (unsigned)corpus.size());
+    unsigned end = min(begin + chunk, (unsigned)corpus.size());
+    workers.push_back(fork_worker([&, begin, end](int, int out_fd){
+	  vector<unsigned> pl;
+	  vector<vector<float>> ps;
+	  vector<Record> rs;
+	  eval_range(begin, end, pl, ps, rs, nullptr);
+	  // for each doc: prediction, (size, probabilities)
+	  // and, with b_record, (size, record)
+	  for (unsigned k = 0; k < pl.size(); k++){
+	    unsigned n = ps[k].size();
+	    write_all(out_fd, &pl[k], sizeof(unsigned));
+	    write_all(out_fd, &n, sizeof(n));
+	    write_all(out_fd, ps[k].data(), n * sizeof(float));
+	    if (!b_record) continue;
+	    n = rs[k].size();
+	    write_all(out_fd, &n, sizeof(n));
+	    write_all(out_fd, rs[k].data(), n * sizeof(Record::value_type));
+	  }
+	}));
+  }
+  // the first slice is done here
+  eval_range(0, min(chunk, (unsigned)corpus.size()), plabels, probs, records, metrics);
+  for (unsigned w = 1; w < nworkers; w++){
+    unsigned begin = min(w * chunk, (unsigned)corpus.size());
+    unsigned end = min(begin + chunk, (unsigned)corpus.size());
+    Worker& worker = workers[w-1];
+    bool b_ok = true;
+    for (unsigned i = begin; b_ok and (i < end); i++){
+      unsigned plabel = 0, n = 0;
+      b_ok = read_all(worker.from_fd, &plabel, sizeof(plabel))
+	and read_all(worker.from_fd, &n, sizeof(n));
+      plabels.push_back(plabel);
+      probs.push_back(vector<float>(n));
+      if (b_ok) b_ok = read_all(worker.from_fd, probs.back().data(), n * sizeof(float));
+      if (!(b_ok and b_record)) continue;
+      b_ok = read_all(worker.from_fd, &n, sizeof(n));
+      records.push_back(Record(n));
+      if (b_ok) b_ok = read_all(worker.from_fd, records.back().data(), n * sizeof(Record::value_type));
+    }
+    if (!b_ok){
+      cerr << "Lost evaluation worker " << w << endl;
+      exit(1);
+    }
+    wait_worker(worker);
+  }
+  float correct = 0;
+  for (unsigned i = 0; i < corpus.size(); i++)
+    if (plabels[i] == corpus[i].label) correct += 1;
+  return correct / corpus.size();
+}
+
+// *******************************************************
+// One configuration of a sweep
+//
+// Trains a model with the options of cfg on corpora loaded
+// by the caller, niter passes over the training docs with
+// an evaluation on the dev docs after each pass, and writes
+// the best model to fmodel. The embedding table, if any, is
+// loaded by the caller too. Return the best dev accuracy
+// *******************************************************
+float train_config(const SweepConfig& cfg, const Corpus& trncorpus,
+		   const Corpus& devcorpus, Dict& d, unsigned nclass,
+		   unsigned ndisrela, const float* embed, unsigned niter,
+		   unsigned batchsize, bool b_bucket, bool b_sparse,
+		   const TrainerParams& tparams, const string& fmodel){
+  Model model;
+  TextClass<LSTMBuilder> tc(model, cfg.inputdim, cfg.hiddendim, cfg.nlayer,
+			    nclass, ndisrela, d.size(), d, embed, cfg.arch);
+  unique_ptr<Trainer> sgd(new_trainer(model, cfg.trainer, cfg.lr, tparams));
+  if (!sgd){
+    cerr << "Unrecognized trainer " << cfg.trainer << endl;
+    exit(1);
+  }
+  unique_ptr<SparseUpdater> sparse;
+  if (b_sparse) sparse.reset(new SparseUpdater(model, sgd.get(), cfg.trainer, tparams));
+  ModelInfo info = {cfg.arch, cfg.nlayer, cfg.inputdim, cfg.hiddendim,
+		    nclass, ndisrela, d.size()};
+  float best_dev_acc = 0.0;
+  for (unsigned iter = 0; iter < niter; iter++){
+    if (iter > 0) sgd->update_epoch();
+    for (auto& batch : make_batches(trncorpus, batchsize, b_bucket, *rndeng)){
+      ComputationGraph cg;
+      vector<const Doc*> docs;
+      for (auto didx : batch) docs.push_back(&trncorpus[didx]);
+      Expression loss_expr = sum(tc.build_model(docs, cg, cfg.droprate, false));
+      cg.forward(loss_expr);
+      cg.backward(loss_expr);
+      if (sparse) sparse->update();
+      else sgd->update();
+    }
+    // the configs run side by side, so one evaluation worker
+    vector<unsigned> plabels;
+    vector<vector<float>> probs;
+    vector<Record> records;
+    float dev_acc = evaluate(&tc, devcorpus, 0.0, 1, false, plabels, probs, records);
+    if (dev_acc > best_dev_acc){
+      best_dev_acc = dev_acc;
+      save_model(fmodel, model, info);
+    }
+  }
+  return best_dev_acc;
+}
+
+
 int main(int argc, char** argv) {
   dynet::initialize(argc, argv);
 
@@ -46,6 +221,8 @@ int main(int argc, char** argv) {
     ("tstfile", po::value<string>()->default_value(string("")), "test file")
     ("dctfile", po::value<string>()->default_value(string("")), "dict file")
     ("modfile", po::value<string>()->default_value(string("")), "model file")
+    ("sweepfile", po::value<string>()->default_value(string("")), "grid of configurations for --task sweep")
+    ("qmodfile", po::value<string>()->default_value(string("")), "quantized model file (from --task quantize), for test/serve without the model file")
     ("arch", po::value<unsigned>()->default_value((unsigned)0), "model architecture")
     ("nclass", po::value<unsigned>()->default_value((unsigned)15), "number of doc classes")
     ("ndisrela", po::value<unsigned>()->default_value((unsigned)36), "number of discourse relations")
@@ -54,10 +231,31 @@ int main(int argc, char** argv) {
     ("nlayer", po::value<unsigned>()->default_value((unsigned)1), "number of hidden layers")
     ("trainer", po::value<unsigned>()->default_value((unsigned)0), "training method")
     ("lr", po::value<float>()->default_value((float)0.1), "learning rate")
+    ("beta1", po::value<float>()->default_value((float)0.9), "beta1 of Adam")
+    ("beta2", po::value<float>()->default_value((float)0.999), "beta2 of Adam")
+    ("eps", po::value<float>()->default_value((float)0), "epsilon of Adagrad/Adam (0: the DyNet default)")
+    ("sparse", po::value<bool>()->default_value((bool)false), "update only the looked-up rows of the lookup parameters (lazy Adagrad/Adam)")
     ("droprate", po::value<float>()->default_value((float)0), "dropout rate")
+    ("batchsize", po::value<unsigned>()->default_value((unsigned)1), "number of docs per update")
+    ("bucket", po::value<bool>()->default_value((bool)false), "batch docs with similar numbers of EDUs")
+    ("nthreads", po::value<unsigned>()->default_value((unsigned)1), "number of training workers")
+    ("trnbuffer", po::value<unsigned>()->default_value((unsigned)0), "stream the training file through a shuffle buffer of this many docs (0: load it all)")
+    ("prefetch", po::value<unsigned>()->default_value((unsigned)8), "number of training batches prepared ahead when streaming")
+    ("async", po::value<bool>()->default_value((bool)false), "asynchronous (Hogwild) updates with more than one worker")
+    ("avgfreq", po::value<unsigned>()->default_value((unsigned)0), "with more than one worker, train on disjoint shards and average the parameters every this many batches (0: sum the gradients of every batch)")
     ("niter", po::value<unsigned>()->default_value((unsigned)1), "number of passes on the training set")
     ("evalfreq", po::value<unsigned>()->default_value((unsigned)1), "evaluation frequency on dev data")
+    ("asynceval", po::value<bool>()->default_value((bool)false), "evaluate on dev data in the background, on a snapshot of the model")
     ("emfile", po::value<string>()->default_value(string("")), "word embedding file")
+    ("nreader", po::value<unsigned>()->default_value((unsigned)0), "number of threads for reading text files (0: all cores)")
+    ("neval", po::value<unsigned>()->default_value((unsigned)0), "number of evaluation workers (0: all cores)")
+    ("tstwindow", po::value<unsigned>()->default_value((unsigned)10000), "number of test docs held in memory")
+    ("educache", po::value<unsigned>()->default_value((unsigned)0), "number of EDU reps cached for test/serve (0: no cache)")
+    ("socket", po::value<string>()->default_value(string("")), "Unix socket of the server (stdin/stdout if empty)")
+    ("maxbatch", po::value<unsigned>()->default_value((unsigned)32), "max number of docs scored together by the server")
+    ("batchwait", po::value<unsigned>()->default_value((unsigned)5), "max time (ms) a doc waits for a server batch")
+    ("record", po::value<bool>()->default_value((bool)false), "send attention weights with the server replies")
+    ("native", po::value<bool>()->default_value((bool)false), "test/serve with the native inference engine instead of DyNet graphs")
     ("evaltrn", po::value<bool>()->default_value((bool)false), "evaluation on training data")
     ("path", po::value<string>()->default_value(string("tmp")), "path to save files")
     ("verbose", po::value<bool>()->default_value((bool)false), "print training information");
@@ -66,7 +264,7 @@ int main(int argc, char** argv) {
   po::notify(vm);
   if (vm.count("help")) {cerr << desc << endl; return 1;}
   if (!vm.count("task")) {
-    cerr << endl << "Please specify the task, either 'train' or 'test'" << endl;
+    cerr << endl << "Please specify the task, either 'train', 'test', 'serve', 'compile', 'quantize' or 'sweep'" << endl;
     return 2;
   }
 
@@ -77,6 +275,8 @@ int main(int argc, char** argv) {
   string ftst = vm["tstfile"].as<string>();
   string fdct = vm["dctfile"].as<string>();
   string fmod = vm["modfile"].as<string>();
+  string fsweep = vm["sweepfile"].as<string>();
+  string fqmod = vm["qmodfile"].as<string>();
   unsigned arch = vm["arch"].as<unsigned>();
   unsigned nclass = vm["nclass"].as<unsigned>();
   unsigned ndisrela = vm["ndisrela"].as<unsigned>();
@@ -84,11 +284,33 @@ int main(int argc, char** argv) {
   unsigned hiddendim = vm["hiddendim"].as<unsigned>();
   unsigned trainer = vm["trainer"].as<unsigned>();
   float lr = vm["lr"].as<float>();
+  TrainerParams tparams;
+  tparams.beta1 = vm["beta1"].as<float>();
+  tparams.beta2 = vm["beta2"].as<float>();
+  tparams.eps = vm["eps"].as<float>();
+  bool b_sparse = vm["sparse"].as<bool>();
   unsigned nlayer = vm["nlayer"].as<unsigned>();
+  unsigned batchsize = vm["batchsize"].as<unsigned>();
+  bool b_bucket = vm["bucket"].as<bool>();
+  unsigned nthreads = vm["nthreads"].as<unsigned>();
+  unsigned trnbuffer = vm["trnbuffer"].as<unsigned>();
+  unsigned prefetch = vm["prefetch"].as<unsigned>();
+  bool b_async = vm["async"].as<bool>();
+  unsigned avgfreq = vm["avgfreq"].as<unsigned>();
   unsigned niter = vm["niter"].as<unsigned>();
   float droprate = vm["droprate"].as<float>();
   unsigned evalfreq = vm["evalfreq"].as<unsigned>();
+  bool b_asynceval = vm["asynceval"].as<bool>();
   string fembed = vm["emfile"].as<string>();
+  unsigned nreader = vm["nreader"].as<unsigned>();
+  unsigned neval = vm["neval"].as<unsigned>();
+  unsigned tstwindow = vm["tstwindow"].as<unsigned>();
+  unsigned educache = vm["educache"].as<unsigned>();
+  string fsocket = vm["socket"].as<string>();
+  unsigned maxbatch = vm["maxbatch"].as<unsigned>();
+  unsigned batchwait = vm["batchwait"].as<unsigned>();
+  bool b_record = vm["record"].as<bool>();
+  bool b_native = vm["native"].as<bool>();
   bool b_evaltrn = vm["evaltrn"].as<bool>();
   string path = vm["path"].as<string>();
   bool b_verbose = vm["verbose"].as<bool>();
@@ -116,12 +338,19 @@ int main(int argc, char** argv) {
   		  "%datetime{%b-%d-%h:%m:%s} %level %msg");
   defaultConf.set(el::Level::Info, 
   		  el::ConfigurationType::Filename, flog.c_str());
+  if ((task == "serve") and (fsocket.size() == 0)){
+    // stdout carries the replies
+    defaultConf.set(el::Level::Global,
+		    el::ConfigurationType::ToStandardOutput, "false");
+  }
   el::Loggers::reconfigureLogger("default", defaultConf);
   
   LOG(INFO) << "[TextClass] training file: " << ftrn;
   LOG(INFO) << "[TextClass] dev file: " << fdev;
   LOG(INFO) << "[TextClass] test file: " << ftst;
   LOG(INFO) << "[TextClass] model file: " << fmod;
+  LOG(INFO) << "[TextClass] sweep file: " << fsweep;
+  LOG(INFO) << "[TextClass] quantized model file: " << fqmod;
   LOG(INFO) << "[TextClass] model architecture: " << arch;
   LOG(INFO) << "[TextClass] number of doc classes: " << nclass;
   LOG(INFO) << "[TextClass] number of discourse relations: " << ndisrela;
@@ -130,10 +359,22 @@ int main(int argc, char** argv) {
   LOG(INFO) << "[TextClass] number of hidden layers: " << nlayer;
   LOG(INFO) << "[TextClass] training method: " << trainer;
   LOG(INFO) << "[TextClass] learning rate: " << lr;
+  LOG(INFO) << "[TextClass] beta1, beta2, eps: " << tparams.beta1 << ", "
+	    << tparams.beta2 << ", " << tparams.eps;
+  LOG(INFO) << "[TextClass] sparse lookup updates: " << b_sparse;
+  LOG(INFO) << "[TextClass] batch size: " << batchsize;
+  LOG(INFO) << "[TextClass] length-bucketed batches: " << b_bucket;
+  LOG(INFO) << "[TextClass] number of training workers: " << nthreads;
+  LOG(INFO) << "[TextClass] training shuffle buffer: " << trnbuffer;
+  LOG(INFO) << "[TextClass] asynchronous updates: " << b_async;
+  LOG(INFO) << "[TextClass] parameter averaging frequency: " << avgfreq;
   LOG(INFO) << "[TextClass] number of iterations: " << niter;
   LOG(INFO) << "[TextClass] dropout rate (0: no dropout): " << droprate;
   LOG(INFO) << "[TextClass] evaluation frequency on dev data: " << evalfreq;
+  LOG(INFO) << "[TextClass] background dev evaluation: " << b_asynceval;
   LOG(INFO) << "[TextClass] word embedding file: " << fembed;
+  LOG(INFO) << "[TextClass] number of reader threads: " << nreader;
+  LOG(INFO) << "[TextClass] number of evaluation workers: " << neval;
   LOG(INFO) << "[TextClass] evaluation on training data: " << b_evaltrn;
   LOG(INFO) << "[TextClass] output path: " << path;
   LOG(INFO) << "[TextClass] verbose: " << b_verbose;
@@ -143,17 +384,72 @@ int main(int argc, char** argv) {
   if ((task == "train") and ((ftrn.size() == 0) or (fdev.size() == 0))){
     cerr << "Please specify training and dev files" << endl;
     return 3;
-  } else if ((task == "test") and ((ftst.size() == 0) or (fdct.size() == 0) or (fmod.size() == 0))){
+  } else if ((task == "train") and ((batchsize == 0) or (nthreads == 0))){
+    cerr << "Batch size and number of workers should be at least 1" << endl;
+    return 3;
+  } else if ((task == "train") and b_async and (avgfreq > 0)){
+    cerr << "Asynchronous updates and parameter averaging do not go together" << endl;
+    return 3;
+  } else if ((task == "train") and (trnbuffer > 0) and ((nthreads > 1) or (fdct.size() == 0))){
+    cerr << "Streaming the training file needs one worker and a dict file" << endl;
+    return 3;
+  } else if ((task == "test") and ((ftst.size() == 0) or (fdct.size() == 0)
+				   or ((fmod.size() == 0) and (fqmod.size() == 0)))){
     cerr << "Please specify dev, dict and model files" << endl;
     return 4;
+  } else if ((task == "test") and (tstwindow == 0)){
+    cerr << "Test window should be at least 1" << endl;
+    return 4;
+  } else if ((task == "serve") and ((fdct.size() == 0)
+				    or ((fmod.size() == 0) and (fqmod.size() == 0)))){
+    cerr << "Please specify dict and model files" << endl;
+    return 4;
+  } else if ((task == "quantize") and ((fdct.size() == 0) or (fmod.size() == 0))){
+    cerr << "Please specify dict and model files" << endl;
+    return 4;
+  } else if ((task == "sweep") and ((ftrn.size() == 0) or (fdev.size() == 0) or (fsweep.size() == 0))){
+    cerr << "Please specify training, dev and sweep files" << endl;
+    return 3;
+  } else if ((task == "sweep") and ((batchsize == 0) or (nthreads == 0))){
+    cerr << "Batch size and number of workers should be at least 1" << endl;
+    return 3;
+  } else if ((task == "sweep") and (evalfreq != 1)){
+    // each config is evaluated after each pass
+    cerr << "The sweep does not take an evaluation frequency" << endl;
+    return 3;
+  } else if ((task == "compile") and (ftrn.size() == 0) and (fdct.size() == 0)){
+    cerr << "Please specify a training file or a dict file" << endl;
+    return 6;
   }
 
   Corpus trncorpus, devcorpus, tstcorpus;
   unsigned vocab_size;
-  if (task == "train"){
+  size_t ntrn = 0; // docs in the training file
+  if ((task == "train") and (trnbuffer > 0)){
+    // the training file is streamed, its word ids come from
+    // the dict
+    load_dict(fdct, d);
+    d.freeze();
+    vocab_size = d.size();
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "[TextClass] vocab size: " << vocab_size;
+#endif
+    save_dict(fprefix+".dict", d);
+    ntrn = count_docs(ftrn);
+    devcorpus = read_corpus((char*)fdev.c_str(), &d, false, nreader);
+  } else if ((task == "train") or (task == "sweep")){
     // kSOS = d.convert("<s>");
     // kEOS = d.convert("</s>");
-    trncorpus = read_corpus((char*)ftrn.c_str(), &d, true);
+    if (is_compiled_corpus(ftrn)){
+      // word ids in a compiled corpus come from its own dict
+      if (fdct.size() == 0){
+	cerr << "Please specify the dict file of the compiled training file" << endl;
+	return 6;
+      }
+      load_dict(fdct, d);
+    }
+    trncorpus = read_corpus((char*)ftrn.c_str(), &d, true, nreader);
+    ntrn = trncorpus.size();
     d.freeze(); // no new word types allowed
     vocab_size = d.size();
     // cout << "vocab size: " << vocab_size << endl;
@@ -163,7 +459,7 @@ int main(int argc, char** argv) {
     // save dict
     save_dict(fprefix+".dict", d);
     // read dev corpus
-    devcorpus = read_corpus((char*)fdev.c_str(), &d, false);
+    devcorpus = read_corpus((char*)fdev.c_str(), &d, false, nreader);
   } else if (task == "test"){
     // load dict
     load_dict(fdct, d);
@@ -173,8 +469,50 @@ int main(int argc, char** argv) {
 #if _NO_DEBUG_MODE_
     LOG(INFO) << "[TextClass] vocab size " << vocab_size;
 #endif 
-    // load test corpus
-    tstcorpus = read_corpus((char*)ftst.c_str(), &d, false);
+    // the test corpus is read while evaluating
+  } else if (task == "serve"){
+    // docs come with the requests
+    load_dict(fdct, d);
+    d.freeze();
+    vocab_size = d.size();
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "[TextClass] vocab size " << vocab_size;
+#endif
+  } else if (task == "quantize"){
+    // the dev file, if any, is for the accuracy report
+    load_dict(fdct, d);
+    d.freeze();
+    vocab_size = d.size();
+    if (fdev.size() > 0)
+      devcorpus = read_corpus((char*)fdev.c_str(), &d, false, nreader);
+  } else if (task == "compile"){
+    // tokenize once, write binary files for train/test
+    if (fdct.size() > 0){
+      load_dict(fdct, d);
+      d.freeze();
+    } else {
+      trncorpus = read_corpus((char*)ftrn.c_str(), &d, true, nreader);
+      d.freeze();
+      save_dict(fprefix+".dict", d);
+#if _NO_DEBUG_MODE_
+      LOG(INFO) << "Save dict to: " << fprefix << ".dict";
+#endif
+    }
+    vector<string> fnames = {ftrn, fdev, ftst};
+    for (auto& fname : fnames){
+      if (fname.size() == 0) continue;
+      Corpus corpus;
+      if ((fname != ftrn) or (trncorpus.size() == 0)){
+	corpus = read_corpus((char*)fname.c_str(), &d, false, nreader);
+      }
+      const Corpus& cpcorpus = (corpus.size() > 0) ? corpus : trncorpus;
+      string fbin = path + "/" + boost::filesystem::path(fname).filename().string() + ".bin";
+      if (save_compiled_corpus(fbin, cpcorpus, d) != 0) return 7;
+#if _NO_DEBUG_MODE_
+      LOG(INFO) << "Compile " << fname << " to: " << fbin;
+#endif
+    }
+    return 0;
   } else {
 #if _NO_DEBUG_MODE_
     LOG(INFO) << "Unrecognized task label " << task;
@@ -188,14 +526,9 @@ int main(int argc, char** argv) {
   Model model;
   Trainer* sgd = nullptr;
   if (task == "train"){
-    if (trainer == 0){
-      sgd = new SimpleSGDTrainer(model, lr);
-      // sgd->eta_decay = 0.08;
-    } else if (trainer == 1){
-      sgd = new AdagradTrainer(model, lr);
-    } else if (trainer == 2){
-      sgd = new AdamTrainer(model, lr);
-    } else {
+    sgd = new_trainer(model, trainer, lr, tparams);
+    // sgd->eta_decay = 0.08;
+    if (sgd == nullptr){
 #if _NO_DEBUG_MODE_
       LOG(INFO) << "Unrecognized trainer " << trainer;
 #else
@@ -204,24 +537,338 @@ int main(int argc, char** argv) {
       exit(1);
     }
   }
-  if (fmod.size() > 0){
-    // load pretrained model
-    load_model(fmod, model);
+  // a quantized model replaces the model for test and serve
+  bool b_qmod = (fqmod.size() > 0) and ((task == "test") or (task == "serve"));
+  unique_ptr<TextClass<LSTMBuilder>> ptc;
+  // a sweep builds its own models
+  if ((!b_qmod) and (task != "sweep")){
+    const float* embed = nullptr;
+    if (fembed.size() > 0) embed = load_embedding_table(fembed, d, inputdim);
+    ptc.reset(new TextClass<LSTMBuilder>(model, inputdim, hiddendim, nlayer,
+					 nclass, ndisrela, vocab_size,
+					 d, embed, arch));
   }
-  TextClass<LSTMBuilder> tc(model, inputdim, hiddendim, nlayer,
-			    nclass, ndisrela, vocab_size,
-			    d, fembed, arch);
+  // configuration checked against a loaded model
+  ModelInfo info = {arch, nlayer, inputdim, hiddendim,
+		    nclass, ndisrela, vocab_size};
+  if ((fmod.size() > 0) and (!b_qmod)){
+    // load pretrained model, after all the parameters are added
+    load_model(fmod, model, info);
+  }
+  // the parameters are fixed from here for test and serve
+  // graph-free inference for test and serve
+  unique_ptr<InferEngine> engine;
+  if (b_qmod){
+    engine.reset(InferEngine::load(fqmod, d));
+  } else if (b_native and ((task == "test") or (task == "serve"))){
+    engine.reset(new InferEngine(ptc->infer_source()));
+  }
+  if (engine){
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "Native inference with " << InferEngine::kernels() << " kernels"
+	      << (engine->quantized() ? " and int8 weights" : "");
+#else
+    cerr << "Native inference with " << InferEngine::kernels() << " kernels"
+	 << (engine->quantized() ? " and int8 weights" : "") << endl;
+#endif
+  }
+  unique_ptr<EduCache> cache;
+  if ((educache > 0) and ((task == "test") or (task == "serve"))){
+    cache.reset(new EduCache(educache, engine ? engine->dim() : 2 * hiddendim));
+    if (ptc) ptc->set_edu_cache(cache.get());
+    if (engine) engine->set_edu_cache(cache.get());
+  }
+  // print the usage of the EDU cache
+  auto report_cache = [&](){
+    if (!cache) return;
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "EDU cache: " << cache->size() << " entries, "
+	      << cache->hits() << " hits, " << cache->misses() << " misses";
+#else
+    cout << "EDU cache: " << cache->size() << " entries, "
+	 << cache->hits() << " hits, " << cache->misses() << " misses" << endl;
+#endif
+  };
 
   // start do sth
   if (task == "train"){
+    TextClass<LSTMBuilder>& tc = *ptc;
+    // the lookup parameters can be updated row by row, in
+    // place of the trainer
+    unique_ptr<SparseUpdater> sparse;
+    if (b_sparse) sparse.reset(new SparseUpdater(model, sgd, trainer, tparams));
+    auto update = [&](float scale){
+      if (sparse) sparse->update(scale);
+      else sgd->update(scale);
+    };
     unsigned reportfreq = 50;
     float best_dev_acc = 0.0;
-    vector<unsigned> order(trncorpus.size());
-    for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+    // time of each phase, written at every report
+    Metrics metrics(fprefix + ".metrics.jsonl");
+    // the best model is written in the background
+    ModelSaver saver;
+    vector<vector<unsigned>> batches;
     bool first = true;
     int report = 0;
-    unsigned si = trncorpus.size();
-    niter = (unsigned)(niter*trncorpus.size()/reportfreq);
+    unsigned si = 0; // next batch
+    niter = (unsigned)(niter*ntrn/reportfreq);
+    // next batch of doc indices, reshuffle at the end of each epoch
+    auto next_batch = [&]() -> vector<unsigned> {
+      if (si == batches.size()) {
+	si = 0;
+	if (first) { first = false;} else { sgd->update_epoch();}
+	if (b_verbose) {
+#if _NO_DEBUG_MODE_
+	  LOG(INFO) << "*** SHUFFLE ***";
+#else
+	  cout << "*** SHUFFLE ***" << endl;
+#endif
+	}
+	batches = make_batches(trncorpus, batchsize, b_bucket, *rndeng);
+      }
+      return batches[si++];
+    };
+    auto batch_tokens = [&](const vector<unsigned>& batch) -> unsigned long {
+      unsigned long n_token = 0;
+      for (auto didx : batch) n_token += trncorpus[didx].n_tokens();
+      return n_token;
+    };
+    // build one graph for all instances in a batch, return its loss
+    auto train_docs = [&](const vector<const Doc*>& docs) -> double {
+      ComputationGraph cg;
+      Expression loss_expr;
+      double loss = 0;
+      {
+	PhaseTimer timer(metrics, PH_BUILD);
+	vector<Expression> losses = tc.build_model(docs, cg, droprate, false);
+	loss_expr = sum(losses);
+      }
+      {
+	PhaseTimer timer(metrics, PH_FORWARD);
+	loss = as_scalar(cg.forward(loss_expr));
+      }
+      {
+	PhaseTimer timer(metrics, PH_BACKWARD);
+	cg.backward(loss_expr);
+      }
+      unsigned long n_token = 0;
+      for (auto doc : docs) n_token += doc->n_tokens();
+      metrics.count(docs.size(), n_token, cg.nodes.size());
+      return loss;
+    };
+    auto train_batch = [&](const vector<unsigned>& batch) -> double {
+      vector<const Doc*> docs;
+      for (auto didx : batch) docs.push_back(&trncorpus[didx]);
+      return train_docs(docs);
+    };
+    // with a shuffle buffer, batches come from the reader
+    // thread; an epoch is ntrn docs
+    unique_ptr<DocStream> stream;
+    if (trnbuffer > 0)
+      stream.reset(new DocStream(ftrn, &d, trnbuffer, batchsize, b_bucket, prefetch, (*rndeng)()));
+    size_t nstreamed = 0;
+    auto train_stream = [&](unsigned& n) -> double {
+      Corpus batch;
+      {
+	PhaseTimer timer(metrics, PH_INPUT);
+	batch = stream->next();
+      }
+      vector<const Doc*> docs;
+      for (auto& doc : batch) docs.push_back(&doc);
+      nstreamed += docs.size();
+      if (nstreamed >= ntrn){
+	nstreamed -= ntrn;
+	sgd->update_epoch();
+      }
+      n = docs.size();
+      return train_docs(docs);
+    };
+    // batches over the docs of one worker, reshuffled at the
+    // end of each pass
+    struct Shard{
+      vector<unsigned> docs;
+      vector<vector<unsigned>> batches;
+      unsigned si = 0;
+      bool first = true;
+    };
+    auto next_shard_batch = [&](Shard& shard) -> vector<unsigned> {
+      if (shard.si == shard.batches.size()){
+	shard.si = 0;
+	if (shard.first) { shard.first = false;} else { sgd->update_epoch();}
+	shard.batches = make_batches(trncorpus, shard.docs, batchsize, b_bucket, *rndeng);
+      }
+      return shard.batches[shard.si++];
+    };
+    // what a worker reports after a round of batches
+    struct RoundStat{
+      double loss;
+      unsigned long ndocs;
+      unsigned long ntokens;
+    };
+    // training workers, they share the parameter values
+    // unless they are averaged
+    vector<Worker> workers;
+    TrainControl* ctrl = nullptr;
+    char* slots = nullptr;
+    size_t slot_size = 0;
+    unsigned max_rows = 0;
+    unsigned long ndocs_done = 0, ntokens_done = 0;
+    double loss_done = 0;
+    Shard myshard;
+    if ((nthreads > 1) and (avgfreq > 0)){
+      // local SGD: every worker trains its own copy on its own
+      // shard for avgfreq batches, then the copies are averaged
+      // here. Slot 0 holds the average, slot w the values of
+      // worker w
+      if (trncorpus.size() < nthreads){
+	cerr << "Fewer training docs than workers" << endl;
+	exit(3);
+      }
+      unsigned seed = (*rndeng)();
+      for (unsigned i = 0; i < trncorpus.size(); i += nthreads) myshard.docs.push_back(i);
+      slot_size = value_slot_size(model);
+      slots = (char*)shared_alloc(slot_size * nthreads);
+      for (unsigned w = 1; w < nthreads; w++){
+	workers.push_back(fork_worker([&, w](int in_fd, int out_fd){
+	      rndeng->seed(seed + w);
+	      Shard shard;
+	      for (unsigned i = w; i < trncorpus.size(); i += nthreads) shard.docs.push_back(i);
+	      unsigned n;
+	      while (read_all(in_fd, &n, sizeof(n)) and (n > 0)){
+		unpack_values(model, (const float*)slots);
+		RoundStat stat = {0, 0, 0};
+		for (unsigned k = 0; k < n; k++){
+		  vector<unsigned> batch = next_shard_batch(shard);
+		  stat.loss += train_batch(batch);
+		  update(1.0);
+		  stat.ndocs += batch.size();
+		  stat.ntokens += batch_tokens(batch);
+		}
+		pack_values(model, (float*)(slots + w * slot_size));
+		if (!write_all(out_fd, &stat, sizeof(stat))) break;
+	      }
+	    }));
+      }
+    } else if (nthreads > 1){
+      share_parameters(model);
+      unsigned seed = (*rndeng)();
+      if (!b_async){
+	// synchronous: each step, every worker does one batch
+	// and sends back its gradients
+	unsigned max_tokens = 0;
+	for (auto& doc : trncorpus) max_tokens = max(max_tokens, doc.n_tokens());
+	max_rows = max_tokens * batchsize;
+	slot_size = grad_slot_size(model, max_rows);
+	slots = (char*)shared_alloc(slot_size * nthreads);
+	for (unsigned w = 1; w < nthreads; w++){
+	  workers.push_back(fork_worker([&, w](int in_fd, int out_fd){
+		rndeng->seed(seed + w);
+		unsigned n;
+		vector<unsigned> batch;
+		while (read_all(in_fd, &n, sizeof(n)) and (n > 0)){
+		  batch.resize(n);
+		  if (!read_all(in_fd, batch.data(), n * sizeof(unsigned))) break;
+		  double loss = train_batch(batch);
+		  pack_gradients(model, slots + w * slot_size, max_rows);
+		  model.reset_gradient();
+		  if (!write_all(out_fd, &loss, sizeof(loss))) break;
+		}
+	      }));
+	}
+      } else {
+	// asynchronous (Hogwild): every worker trains on its own
+	// shard and updates the shared values without locking
+	ctrl = new_train_control(nthreads);
+	for (unsigned w = 0; w < nthreads; w++){
+	  workers.push_back(fork_worker([&, w](int, int){
+		rndeng->seed(seed + w);
+		vector<unsigned> shard;
+		for (unsigned i = w; i < trncorpus.size(); i += nthreads) shard.push_back(i);
+		WorkerStat& stat = ctrl->stats[w];
+		bool wfirst = true;
+		while (!ctrl->stop.load()){
+		  if (wfirst) { wfirst = false;} else { sgd->update_epoch();}
+		  for (auto& batch : make_batches(trncorpus, shard, batchsize, b_bucket, *rndeng)){
+		    if (ctrl->stop.load()) break;
+		    double loss = train_batch(batch);
+		    update(1.0);
+		    stat.loss.store(stat.loss.load() + loss);
+		    stat.ntokens.fetch_add(batch_tokens(batch));
+		    stat.ndocs.fetch_add(batch.size());
+		  }
+		}
+	      }));
+	}
+      }
+    }
+    // evaluate on dev set, write the dev weight file and
+    // return the accuracy
+    auto eval_dev = [&]() -> float {
+      // attention weights are only kept for the dev weight file
+      vector<unsigned> plabels;
+      vector<vector<float>> probs;
+      vector<Record> records;
+      float dev_acc = evaluate(&tc, devcorpus, 0.0, neval, b_verbose, plabels, probs, records);
+      ofstream devwfile;
+      if (b_verbose) devwfile.open(fprefix + ".devw");
+      // write dev weight file
+      for (unsigned i = 0; b_verbose and (i < devcorpus.size()); i++){
+	devwfile << "file name = " << devcorpus[i].filename() << endl;
+	devwfile << "label = " << devcorpus[i].label << "; plabel = " << plabels[i] << endl;
+	for (auto& p : records[i]){
+	  devwfile << "(" << p.first << " : " << p.second << ") ";
+	}
+	devwfile << endl;
+      }
+      if (b_verbose){
+	devwfile.close();
+#if _NO_DEBUG_MODE_
+	LOG(INFO) << "Dev accuracy = " << boost::format("%1.4f") % dev_acc
+		  << " ( " << boost::format("%1.4f") % best_dev_acc << " )";
+#else
+	cout << "Dev accuracy = " << boost::format("%1.4f") % dev_acc
+	     << " ( " << boost::format("%1.4f") % best_dev_acc << " )" << endl;
+#endif
+      }
+      return dev_acc;
+    };
+    // with --asynceval, the dev set is scored by a forked
+    // process on a copy-on-write snapshot of the model, and
+    // the result is picked up here once it is ready
+    Worker deveval;
+    deveval.pid = -1;
+    int deveval_step = 0;
+    auto collect_dev = [&](bool b_block){
+      if (deveval.pid < 0) return;
+      if ((!b_block) and (!worker_ready(deveval))) return;
+      float dev_acc = 0.0;
+      if (!read_all(deveval.from_fd, &dev_acc, sizeof(dev_acc))){
+	cerr << "Lost dev evaluation" << endl;
+	exit(1);
+      }
+      wait_worker(deveval);
+      deveval.pid = -1;
+      if (b_verbose){
+#if _NO_DEBUG_MODE_
+	LOG(INFO) << "Dev accuracy at report " << deveval_step << " = "
+		  << boost::format("%1.4f") % dev_acc;
+#else
+	cout << "Dev accuracy at report " << deveval_step << " = "
+	     << boost::format("%1.4f") % dev_acc << endl;
+#endif
+      }
+      if (dev_acc > best_dev_acc){
+	// already written by the evaluation process
+	if (b_verbose){
+#if _NO_DEBUG_MODE_
+	  LOG(INFO) << "Saved model to: " << fprefix;
+#else
+	  cout << "Saved model to: " << fprefix << endl;
+#endif
+	}
+	best_dev_acc = dev_acc;
+      }
+    };
     while(report < niter) {
       // cout << "Whole training procedure finished: " << boost::format("%1.4f") % (float)report/niter << endl;
       if (b_verbose){
@@ -234,29 +881,101 @@ int main(int argc, char** argv) {
       }
       double loss = 0;
       unsigned ni = 0;
-      for (unsigned i = 0; i < reportfreq; ++i) {
-	if (si == trncorpus.size()) {
-	  si = 0;
-	  if (first) { first = false;} else { sgd->update_epoch();}
-	  if (b_verbose) {
-#if _NO_DEBUG_MODE_
-	    LOG(INFO) << "*** SHUFFLE ***";
-#else
-	    cout << "*** SHUFFLE ***" << endl;
-#endif
+      if (nthreads == 1){
+	while (ni < reportfreq) {
+	  unsigned n = 0;
+	  if (stream){
+	    loss += train_stream(n);
+	  } else {
+	    vector<unsigned> batch = next_batch();
+	    loss += train_batch(batch);
+	    n = batch.size();
 	  }
-	  shuffle(order.begin(), order.end(), *rndeng);
+	  ni += n;
+	  PhaseTimer timer(metrics, PH_UPDATE);
+	  update(1.0);
 	}
-	
-	// build graph for this instance
-	ComputationGraph cg;
-	auto& doc = trncorpus[order[si]];
-	si ++; ni ++;
-	Record record;
-	Expression loss_expr = tc.build_model(doc, cg, droprate, false, record);
-	loss += as_scalar(cg.forward(loss_expr));
-	cg.backward(loss_expr);
-	sgd->update();
+      } else if (avgfreq > 0){
+	while (ni < reportfreq) {
+	  // one round: publish the average, every worker (this
+	  // one included) does avgfreq batches on its shard
+	  pack_values(model, (float*)slots);
+	  for (auto& worker : workers) write_all(worker.to_fd, &avgfreq, sizeof(avgfreq));
+	  for (unsigned k = 0; k < avgfreq; k++){
+	    vector<unsigned> batch = next_shard_batch(myshard);
+	    loss += train_batch(batch);
+	    ni += batch.size();
+	    PhaseTimer timer(metrics, PH_UPDATE);
+	    update(1.0);
+	  }
+	  PhaseTimer timer(metrics, PH_SYNC);
+	  vector<const float*> wslots;
+	  for (unsigned w = 1; w < nthreads; w++){
+	    RoundStat stat;
+	    if (!read_all(workers[w-1].from_fd, &stat, sizeof(stat))){
+	      cerr << "Lost training worker " << w << endl;
+	      exit(1);
+	    }
+	    loss += stat.loss;
+	    ni += stat.ndocs;
+	    // graph nodes are only counted for this process
+	    metrics.count(stat.ndocs, stat.ntokens, 0);
+	    wslots.push_back((const float*)(slots + w * slot_size));
+	  }
+	  average_values(model, wslots);
+	}
+      } else if (!b_async){
+	while (ni < reportfreq) {
+	  // one batch for each worker, the first one is done here
+	  vector<unsigned> mybatch = next_batch();
+	  for (auto& worker : workers){
+	    vector<unsigned> batch = next_batch();
+	    unsigned n = batch.size();
+	    write_all(worker.to_fd, &n, sizeof(n));
+	    write_all(worker.to_fd, batch.data(), n * sizeof(unsigned));
+	    ni += n;
+	    // graph nodes are only counted for this process
+	    metrics.count(n, batch_tokens(batch), 0);
+	  }
+	  loss += train_batch(mybatch);
+	  ni += mybatch.size();
+	  // sum up the gradients in worker order
+	  {
+	    PhaseTimer timer(metrics, PH_SYNC);
+	    for (unsigned w = 1; w < nthreads; w++){
+	      double wloss = 0;
+	      if (!read_all(workers[w-1].from_fd, &wloss, sizeof(wloss))){
+		cerr << "Lost training worker " << w << endl;
+		exit(1);
+	      }
+	      loss += wloss;
+	      add_gradients(model, slots + w * slot_size, max_rows);
+	    }
+	  }
+	  // average over workers
+	  PhaseTimer timer(metrics, PH_UPDATE);
+	  update(1.0 / nthreads);
+	}
+      } else {
+	// wait for the workers to go through another reportfreq docs
+	unsigned long ndocs = 0, ntokens = 0;
+	double wloss = 0;
+	while (true){
+	  ndocs = 0; ntokens = 0; wloss = 0;
+	  for (unsigned w = 0; w < nthreads; w++){
+	    ndocs += ctrl->stats[w].ndocs.load();
+	    ntokens += ctrl->stats[w].ntokens.load();
+	    wloss += ctrl->stats[w].loss.load();
+	  }
+	  if (ndocs >= ndocs_done + reportfreq) break;
+	  usleep(10000);
+	}
+	loss = wloss - loss_done;
+	ni = ndocs - ndocs_done;
+	metrics.count(ni, ntokens - ntokens_done, 0);
+	loss_done = wloss;
+	ndocs_done = ndocs;
+	ntokens_done = ntokens;
       }
       if (b_verbose){
 	sgd->status();
@@ -273,72 +992,83 @@ int main(int argc, char** argv) {
       if (report % evalfreq == 0) {
 	// evaluate on training set
 	// if (b_verbose) cerr << endl;
-	if (b_evaltrn){
-	  float trncorrect = 0;
-	  for (auto& doc : trncorpus) {
-	    ComputationGraph cg;
-	    Record record;
-	    Expression loss_expr = tc.build_model(doc, cg, 0.0, true, record);
-	    vector<float> prob = as_vector(cg.forward(loss_expr));
-	    unsigned plabel = distance(prob.begin(), max_element(prob.begin(), prob.end()));
-	    if (plabel == doc.label) trncorrect += 1;
+	if (b_evaltrn and (trncorpus.size() > 0)){
+	  vector<unsigned> plabels;
+	  vector<vector<float>> probs;
+	  vector<Record> records;
+	  float trn_acc = 0.0;
+	  {
+	    PhaseTimer timer(metrics, PH_EVAL);
+	    trn_acc = evaluate(&tc, trncorpus, 0.0, neval, false, plabels, probs, records);
 	  }
-	  // cout << "Trn accuracy = " << boost::format("%1.4f") % (trncorrect/trncorpus.size()) << endl;
+	  // cout << "Trn accuracy = " << boost::format("%1.4f") % trn_acc << endl;
 	  if (b_verbose){
 #if _NO_DEBUG_MODE_	    
-	    LOG(INFO) << "Trn accuracy = " << boost::format("%1.4f") % (trncorrect/trncorpus.size());
+	    LOG(INFO) << "Trn accuracy = " << boost::format("%1.4f") % trn_acc;
 #else
-	    cout << "Trn accuracy = " << boost::format("%1.4f") % (trncorrect/trncorpus.size()) << endl;
+	    cout << "Trn accuracy = " << boost::format("%1.4f") % trn_acc << endl;
 #endif
 	  }
 	}
-	// evaluate on dev set
-	float devcorrect = 0;
-	ofstream devwfile;
-	if (b_verbose) devwfile.open(fprefix + ".devw");
-	for (auto& doc : devcorpus) {
-	  ComputationGraph cg;
-	  Record record;
-	  Expression loss_expr = tc.build_model(doc, cg, 0.0, true, record);
-	  vector<float> prob = as_vector(cg.forward(loss_expr));
-	  unsigned plabel = distance(prob.begin(), max_element(prob.begin(), prob.end()));
-	  if (plabel == doc.label) devcorrect += 1;
-	  // write dev weight file
-	  if (b_verbose){
-	    devwfile << "file name = " << doc.filename << endl;
-	    devwfile << "label = " << doc.label << "; plabel = " << plabel << endl;
-	    for (auto& p : record){
-	      devwfile << "(" << p.first << " : " << p.second << ") ";
-	    }
-	    devwfile << endl;
+	if (!b_asynceval){
+	  {
+	    PhaseTimer timer(metrics, PH_EVAL);
+	    dev_acc = eval_dev();
 	  }
-	}
-	dev_acc = devcorrect/devcorpus.size();
-	if (b_verbose){
+	  if (dev_acc > best_dev_acc) {
+	    // cout << " Save model to: " << fprefix << endl;
+	    if (b_verbose){
 #if _NO_DEBUG_MODE_
-	  LOG(INFO) << "Dev accuracy = " << boost::format("%1.4f") % dev_acc
-		    << " ( " << boost::format("%1.4f") % best_dev_acc << " )";
+	      LOG(INFO) << "Save model to: " << fprefix;
 #else
-	  cout << "Dev accuracy = " << boost::format("%1.4f") % dev_acc
-	       << " ( " << boost::format("%1.4f") % best_dev_acc << " )" << endl;
+	      cout << "Save model to: " << fprefix << endl;
 #endif
+	    }
+	    best_dev_acc = dev_acc;
+	    // only the snapshot is taken here
+	    PhaseTimer timer(metrics, PH_SAVE);
+	    saver.save(fprefix+".model", model, info);
+	  }
+	} else {
+	  // one evaluation at a time, the previous one has had a
+	  // whole evaluation period to finish
+	  collect_dev(true);
+	  PhaseTimer timer(metrics, PH_EVAL);
+	  float best = best_dev_acc;
+	  deveval = fork_worker([&, best](int, int out_fd){
+		// the values are copied on write from here, unless
+		// they are shared with the training workers
+		if ((nthreads > 1) and (avgfreq == 0)) unshare_parameters(model);
+		char ready = 1;
+		if (!write_all(out_fd, &ready, 1)) return;
+		float acc = eval_dev();
+		// the best model is written from this snapshot
+		if (acc > best) save_snapshot(fprefix+".model", snapshot_model(model, info));
+		write_all(out_fd, &acc, sizeof(acc));
+	      });
+	  char ready = 0;
+	  if (!read_all(deveval.from_fd, &ready, 1)){
+	    cerr << "Lost dev evaluation" << endl;
+	    exit(1);
+	  }
+	  deveval_step = report;
 	}
-	if (dev_acc > best_dev_acc) {
-	  // cout << " Save model to: " << fprefix << endl;
-	  if (b_verbose){
+      }
+      if (b_asynceval) collect_dev(false);
+      string summary = metrics.report("train", report);
 #if _NO_DEBUG_MODE_
-	    LOG(INFO) << "Save model to: " << fprefix;
+      LOG(INFO) << summary;
 #else
-	    cout << "Save model to: " << fprefix << endl;
+      cout << summary << endl;
 #endif
-	  }
-	  best_dev_acc = dev_acc;
-	  save_model(fprefix+".model", model);
-	}
-	if (b_verbose) devwfile.close();
-      }
     }
-    // cerr << "Result for SMAC: SUCCESS, 0, 0, " << best_dev_acc << ", 0" << endl;
+    collect_dev(true);
+    saver.wait();
+    // stop the workers
+    if (ctrl != nullptr) ctrl->stop.store(1);
+    for (auto& worker : workers) wait_worker(worker);
+    if (ctrl != nullptr) free_train_control(ctrl, nthreads);
+    if (slots != nullptr) shared_free(slots, slot_size * nthreads);
     // cout << "Final Dev Accuracy : " << boost::format("%1.4f") % best_dev_acc << endl;
 #if _NO_DEBUG_MODE_
     LOG(INFO) << "Final Dev Accuracy : " << boost::format("%1.4f") % best_dev_acc;
@@ -347,25 +1077,251 @@ int main(int argc, char** argv) {
 #endif
     delete sgd;
   } else if (task == "test"){
-    int counter = 0;
-    float tstcorrect = 0;
-    for (auto& doc : tstcorpus){
-      counter += 1;
-      ComputationGraph cg;
-      Record record;
-      Expression loss_expr = tc.build_model(doc, cg, droprate, true, record);
-      vector<float> prob = as_vector(cg.forward(loss_expr));
-      unsigned plabel = distance(prob.begin(), max_element(prob.begin(), prob.end()));
-      if (plabel == doc.label) tstcorrect += 1;
-      if (b_verbose and (counter % 1000 == 0))
-	cout << "Evaluation finished: " << boost::format("%1.2f") % ((float)counter/tstcorpus.size()) << endl;
+    // evaluate a window of docs at a time, write the predictions
+    // as they come: filename, label, predicted label and the
+    // class probabilities
+    CorpusReader reader(ftst, &d);
+    ofstream predfile(fprefix + ".pred");
+    Metrics metrics(fprefix + ".metrics.jsonl");
+    int window = 0;
+    unsigned long tstcorrect = 0, ndocs = 0;
+    bool b_more = true;
+    while (b_more){
+      tstcorpus.clear();
+      while ((tstcorpus.size() < tstwindow) and (b_more = reader.next(tstcorpus)));
+      vector<unsigned> plabels;
+      vector<vector<float>> probs;
+      vector<Record> records;
+      {
+	// evaluate adds build and forward itself, eval is the
+	// rest: the workers' slices and reading their results
+	double counted = metrics.seconds(PH_BUILD) + metrics.seconds(PH_FORWARD);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	evaluate(ptc.get(), tstcorpus, droprate, neval, false, plabels, probs, records,
+		 engine.get(), &metrics);
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	counted = metrics.seconds(PH_BUILD) + metrics.seconds(PH_FORWARD) - counted;
+	metrics.add(PH_EVAL, max(0.0, secs - counted));
+      }
+      unsigned long n_token = 0;
+      for (auto& tdoc : tstcorpus) n_token += tdoc.n_tokens();
+      metrics.count(tstcorpus.size(), n_token, 0);
+      ndocs += tstcorpus.size();
+      for (unsigned i = 0; i < tstcorpus.size(); i++){
+	if (plabels[i] == tstcorpus[i].label) tstcorrect += 1;
+	predfile << tstcorpus[i].filename() << "\t" << tstcorpus[i].label
+		 << "\t" << plabels[i] << "\t";
+	for (unsigned k = 0; k < probs[i].size(); k++)
+	  predfile << (k > 0 ? " " : "") << probs[i][k];
+	predfile << endl;
+      }
+      if (tstcorpus.size() == 0) continue;
+      string summary = metrics.report("test", window++);
+#if _NO_DEBUG_MODE_
+      LOG(INFO) << summary;
+#else
+      cout << summary << endl;
+#endif
+      if (b_verbose)
+	cerr << "Evaluated " << ndocs << " docs" << endl;
     }
-    float tst_acc = tstcorrect/tstcorpus.size();
+    predfile.close();
+    float tst_acc = (ndocs > 0) ? (float)tstcorrect / ndocs : 0.0;
     // cout << "Final Test Accuracy : " << boost::format("%1.4f") % tst_acc << endl;
 #if _NO_DEBUG_MODE_
     LOG(INFO) << "Final Test Accuracy : " << boost::format("%1.4f") % tst_acc;
 #else
     cout << "Final Test Accuracy : " << boost::format("%1.4f") % tst_acc << endl;
+#endif
+    report_cache();
+  } else if (task == "serve"){
+    // reply: filename, predicted label, class probabilities
+    // and, with --record, the attention weights
+    ServerOptions opts = {fsocket, maxbatch, batchwait, 1000, ndisrela};
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "Serving on " << (fsocket.size() > 0 ? fsocket : string("stdin/stdout"));
+#endif
+    int status = serve(&d, opts, [&](const vector<const Doc*>& docs, vector<string>& replies){
+	  vector<vector<float>> probs(docs.size());
+	  vector<Record> records;
+	  if (engine){
+	    records.resize(docs.size());
+	    for (unsigned k = 0; k < docs.size(); k++)
+	      engine->predict(*docs[k], probs[k], b_record ? &records[k] : nullptr);
+	  } else {
+	    ComputationGraph cg;
+	    vector<Expression> exprs = ptc->build_model(docs, cg, 0.0, true, b_record);
+	    cg.forward(exprs.back());
+	    ptc->cache_edus();
+	    if (b_record) ptc->read_records(records);
+	    for (unsigned k = 0; k < docs.size(); k++) probs[k] = as_vector(exprs[k].value());
+	  }
+	  for (unsigned k = 0; k < docs.size(); k++){
+	    const vector<float>& prob = probs[k];
+	    unsigned plabel = distance(prob.begin(), max_element(prob.begin(), prob.end()));
+	    ostringstream reply;
+	    reply << docs[k]->filename() << "\t" << plabel << "\t";
+	    for (unsigned i = 0; i < prob.size(); i++)
+	      reply << (i > 0 ? " " : "") << prob[i];
+	    if (b_record){
+	      reply << "\t";
+	      for (auto& p : records[k])
+		reply << "(" << p.first << " : " << p.second << ") ";
+	    }
+	    replies.push_back(reply.str());
+	  }
+	});
+    report_cache();
+    return status;
+  } else if (task == "quantize"){
+    // int8 copy of the native engine, then both are compared
+    // on the dev docs, one doc at a time
+    InferEngine fengine(ptc->infer_source());
+    InferEngine qengine(fengine);
+    qengine.quantize();
+    string fqout = fprefix + ".qmodel";
+    if (qengine.save(fqout, d) != 0) return 7;
+    ostringstream summary;
+    summary << "Write quantized model to " << fqout << ": weights "
+	    << fengine.n_bytes()
+	    << " -> " << qengine.n_bytes() << " bytes";
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << summary.str();
+#else
+    cout << summary.str() << endl;
+#endif
+    if (devcorpus.size() == 0) return 0;
+    Metrics metrics(fprefix + ".metrics.jsonl");
+    unsigned long n_token = 0;
+    for (auto& ddoc : devcorpus) n_token += ddoc.n_tokens();
+    vector<unsigned> fplabels, qplabels;
+    vector<vector<float>> fprobs, qprobs;
+    vector<Record> records;
+    double secs[2] = {0, 0};
+    float accs[2] = {0, 0};
+    for (unsigned k = 0; k < 2; k++){
+      auto start = chrono::steady_clock::now();
+      {
+	PhaseTimer timer(metrics, PH_EVAL);
+	accs[k] = evaluate(ptc.get(), devcorpus, 0.0, 1, false,
+			   (k == 0) ? fplabels : qplabels,
+			   (k == 0) ? fprobs : qprobs, records,
+			   (k == 0) ? &fengine : &qengine);
+      }
+      secs[k] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      metrics.count(devcorpus.size(), n_token, 0);
+      string line = metrics.report((k == 0) ? "dev_float" : "dev_int8", 0);
+#if _NO_DEBUG_MODE_
+      LOG(INFO) << line;
+#else
+      cout << line << endl;
+#endif
+    }
+    unsigned agree = 0;
+    float max_diff = 0;
+    for (unsigned i = 0; i < devcorpus.size(); i++){
+      if (fplabels[i] == qplabels[i]) agree += 1;
+      for (unsigned c = 0; c < fprobs[i].size(); c++)
+	max_diff = max(max_diff, fabs(fprobs[i][c] - qprobs[i][c]));
+    }
+    summary.str("");
+    summary << "Dev accuracy " << boost::format("%1.4f") % accs[0]
+	    << " (float) vs " << boost::format("%1.4f") % accs[1]
+	    << " (int8), agreement " << boost::format("%1.4f") % ((float)agree / devcorpus.size())
+	    << ", max prob diff " << max_diff
+	    << ", docs/s " << boost::format("%1.1f") % (devcorpus.size() / secs[0])
+	    << " vs " << boost::format("%1.1f") % (devcorpus.size() / secs[1]);
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << summary.str();
+#else
+    cout << summary.str() << endl;
+#endif
+  } else if (task == "sweep"){
+    // the corpora and the dict are loaded once; each config is
+    // trained by a forked worker, nthreads of them at a time
+    SweepConfig base = {arch, inputdim, hiddendim, nlayer, trainer, lr, droprate};
+    vector<SweepConfig> configs = read_sweep_grid(fsweep, base);
+    // the embedding tables are read here, one per input
+    // dimension, and shared by the workers
+    map<unsigned, const float*> embeds;
+    for (auto& cfg : configs){
+      if ((fembed.size() > 0) and (embeds.count(cfg.inputdim) == 0))
+	embeds[cfg.inputdim] = load_embedding_table(fembed, d, cfg.inputdim);
+    }
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "Sweep over " << configs.size() << " configurations";
+#else
+    cout << "Sweep over " << configs.size() << " configurations" << endl;
+#endif
+    ofstream sweepfile(fprefix + ".sweep");
+    sweepfile << "config\tarch\tinputdim\thiddendim\tnlayer\ttrainer\tlr\tdroprate"
+	      << "\tdev_acc\tseconds\tmodel" << endl;
+    unsigned seed = (*rndeng)();
+    // running workers and the config each one trains
+    vector<pair<Worker, unsigned>> running;
+    unsigned next = 0;
+    float best_dev_acc = 0.0;
+    string best_model;
+    while ((next < configs.size()) or (running.size() > 0)){
+      if ((next < configs.size()) and (running.size() < nthreads)){
+	unsigned k = next++;
+	string fmodel = fprefix + "-" + configs[k].name() + ".model";
+	const float* embed = (fembed.size() > 0) ? embeds[configs[k].inputdim] : nullptr;
+	Worker worker = fork_worker([&, k, fmodel, embed](int, int out_fd){
+	      rndeng->seed(seed + k);
+	      auto start = chrono::steady_clock::now();
+	      float acc = train_config(configs[k], trncorpus, devcorpus, d, nclass,
+				       ndisrela, embed, niter, batchsize, b_bucket, b_sparse,
+				       tparams, fmodel);
+	      double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	      write_all(out_fd, &acc, sizeof(acc));
+	      write_all(out_fd, &secs, sizeof(secs));
+	    });
+	running.push_back(make_pair(worker, k));
+	continue;
+      }
+      // pick up the configs that are done
+      bool b_done = false;
+      for (unsigned i = 0; i < running.size(); i++){
+	if (!worker_ready(running[i].first)) continue;
+	Worker& worker = running[i].first;
+	const SweepConfig& cfg = configs[running[i].second];
+	string fmodel = fprefix + "-" + cfg.name() + ".model";
+	float acc = 0.0;
+	double secs = 0.0;
+	if (!(read_all(worker.from_fd, &acc, sizeof(acc))
+	      and read_all(worker.from_fd, &secs, sizeof(secs)))){
+	  cerr << "Lost sweep worker for " << cfg.name() << endl;
+	  acc = -1;
+	}
+	wait_worker(worker);
+	sweepfile << cfg.name() << "\t" << cfg.arch << "\t" << cfg.inputdim << "\t"
+		  << cfg.hiddendim << "\t" << cfg.nlayer << "\t" << cfg.trainer << "\t"
+		  << cfg.lr << "\t" << cfg.droprate << "\t" << acc << "\t" << secs
+		  << "\t" << fmodel << endl;
+#if _NO_DEBUG_MODE_
+	LOG(INFO) << "[sweep] " << cfg.name() << ": dev accuracy "
+		  << boost::format("%1.4f") % acc << " in " << secs << "s";
+#else
+	cout << "[sweep] " << cfg.name() << ": dev accuracy "
+	     << boost::format("%1.4f") % acc << " in " << secs << "s" << endl;
+#endif
+	if (acc > best_dev_acc){
+	  best_dev_acc = acc;
+	  best_model = fmodel;
+	}
+	running.erase(running.begin() + i);
+	b_done = true;
+	break;
+      }
+      if (!b_done) usleep(10000);
+    }
+#if _NO_DEBUG_MODE_
+    LOG(INFO) << "Best sweep dev accuracy : " << boost::format("%1.4f") % best_dev_acc
+	      << " (" << best_model << ")";
+#else
+    cout << "Best sweep dev accuracy : " << boost::format("%1.4f") % best_dev_acc
+	 << " (" << best_model << ")" << endl;
 #endif
   }
   
@@ -0,0 +1,56 @@
+// metrics.cc
+// Date: Oct. 17, 2026
+
+#include "metrics.h"
+
+#include <iostream>
+#include <sstream>
+
+static const char* PHASE_NAMES[N_PHASES] = {"build", "forward", "backward",
+					    "update", "sync", "eval", "save", "input"};
+
+Metrics::Metrics(const string& fname): out(fname, ios::app){
+  if (!out.good()) cerr << "Cannot write metrics to " << fname << endl;
+  start = since = Clock::now();
+  reset();
+}
+
+void Metrics::reset(){
+  for (unsigned i = 0; i < N_PHASES; i++) secs[i] = 0;
+  ndocs = ntokens = nnodes = 0;
+}
+
+void Metrics::add(Phase phase, double seconds){
+  secs[phase] += seconds;
+}
+
+void Metrics::count(unsigned long n_doc, unsigned long n_token, unsigned long n_node){
+  ndocs += n_doc;
+  ntokens += n_token;
+  nnodes += n_node;
+}
+
+string Metrics::report(const string& event, int step){
+  Clock::time_point now = Clock::now();
+  double window = chrono::duration<double>(now - since).count();
+  double elapsed = chrono::duration<double>(now - start).count();
+  double docs_per_sec = (window > 0) ? ndocs / window : 0.0;
+  double tokens_per_sec = (window > 0) ? ntokens / window : 0.0;
+  ostringstream json, summary;
+  json << "{\"event\": \"" << event << "\", \"step\": " << step
+       << ", \"elapsed\": " << elapsed << ", \"window\": " << window
+       << ", \"docs\": " << ndocs << ", \"tokens\": " << ntokens
+       << ", \"nodes\": " << nnodes << ", \"docs_per_sec\": " << docs_per_sec
+       << ", \"tokens_per_sec\": " << tokens_per_sec;
+  summary << "[" << event << " " << step << "] " << docs_per_sec << " docs/s, "
+	  << tokens_per_sec << " tokens/s";
+  for (unsigned i = 0; i < N_PHASES; i++){
+    json << ", \"" << PHASE_NAMES[i] << "\": " << secs[i];
+    if (secs[i] > 0) summary << ", " << PHASE_NAMES[i] << " " << secs[i] << "s";
+  }
+  json << "}";
+  out << json.str() << endl;
+  since = now;
+  reset();
+  return summary.str();
+}
@@ -0,0 +1,58 @@
+// metrics.h
+// Date: Oct. 17, 2026
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+// *******************************************************
+// Phase counters
+//
+// Wall-clock time spent in each phase, with the numbers of
+// docs, tokens and graph nodes processed. Each report writes
+// the counts since the last report as one JSON line and
+// starts a new window
+// *******************************************************
+enum Phase {PH_BUILD, PH_FORWARD, PH_BACKWARD, PH_UPDATE, PH_SYNC,
+	    PH_EVAL, PH_SAVE, PH_INPUT, N_PHASES};
+
+class Metrics{
+public:
+  // JSON lines are appended to fname
+  Metrics(const string& fname);
+  void add(Phase phase, double seconds);
+  // time of a phase in the current window
+  double seconds(Phase phase) const {return secs[phase];}
+  void count(unsigned long ndocs, unsigned long ntokens, unsigned long nnodes);
+  // write the window, return a one-line summary for the log
+  string report(const string& event, int step);
+
+private:
+  typedef chrono::steady_clock Clock;
+  ofstream out;
+  Clock::time_point start, since;
+  double secs[N_PHASES];
+  unsigned long ndocs, ntokens, nnodes;
+  void reset();
+};
+
+// adds the lifetime of a scope to a phase
+class PhaseTimer{
+public:
+  PhaseTimer(Metrics& metrics, Phase phase):
+    metrics(metrics), phase(phase), start(chrono::steady_clock::now()) {}
+  ~PhaseTimer(){
+    metrics.add(phase, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+  }
+private:
+  Metrics& metrics;
+  Phase phase;
+  chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,279 @@
+// parallel.cc
+// Date: Oct. 17, 2026
+
+#include "parallel.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+Worker fork_worker(function<void(int, int)> fn){
+  int down[2], up[2];
+  if ((pipe(down) != 0) or (pipe(up) != 0)){
+    cerr << "Cannot create pipes for a worker" << endl;
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid < 0){
+    cerr << "Cannot fork a worker" << endl;
+    exit(1);
+  }
+  if (pid == 0){
+    // worker
+    close(down[1]); close(up[0]);
+    fn(down[0], up[1]);
+    close(down[0]); close(up[1]);
+    // skip the destructors and exit handlers of the parent
+    _exit(0);
+  }
+  close(down[0]); close(up[1]);
+  Worker worker;
+  worker.pid = pid;
+  worker.to_fd = down[1];
+  worker.from_fd = up[0];
+  return worker;
+}
+
+int wait_worker(Worker& worker){
+  if (worker.to_fd >= 0) close(worker.to_fd);
+  if (worker.from_fd >= 0) close(worker.from_fd);
+  worker.to_fd = worker.from_fd = -1;
+  int status = 0;
+  waitpid(worker.pid, &status, 0);
+  return status;
+}
+
+bool worker_ready(const Worker& worker){
+  struct pollfd pfd;
+  pfd.fd = worker.from_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+bool read_all(int fd, void* buf, size_t n){
+  char* p = (char*)buf;
+  while (n > 0){
+    ssize_t k = read(fd, p, n);
+    if (k <= 0) return false;
+    p += k; n -= k;
+  }
+  return true;
+}
+
+bool write_all(int fd, const void* buf, size_t n){
+  const char* p = (const char*)buf;
+  while (n > 0){
+    ssize_t k = write(fd, p, n);
+    if (k <= 0) return false;
+    p += k; n -= k;
+  }
+  return true;
+}
+
+void* shared_alloc(size_t nbytes){
+  void* addr = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED){
+    cerr << "Cannot allocate " << nbytes << " bytes of shared memory" << endl;
+    exit(1);
+  }
+  return addr;
+}
+
+void shared_free(void* addr, size_t nbytes){
+  munmap(addr, nbytes);
+}
+
+size_t share_parameters(Model& model){
+  size_t n = 0;
+  for (auto p : model.parameters_list()) n += p->values.d.size();
+  for (auto p : model.lookup_parameters_list()) n += p->all_values.d.size();
+  float* base = (float*)shared_alloc(n * sizeof(float));
+  float* v = base;
+  for (auto p : model.parameters_list()){
+    unsigned sz = p->values.d.size();
+    memcpy(v, p->values.v, sz * sizeof(float));
+    p->values.v = v;
+    v += sz;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned sz = p->all_values.d.size();
+    memcpy(v, p->all_values.v, sz * sizeof(float));
+    p->all_values.v = v;
+    unsigned dim = p->dim.size();
+    for (unsigned i = 0; i < p->values.size(); i++)
+      p->values[i].v = v + i * dim;
+    v += sz;
+  }
+  // the old copies stay with DyNet's memory pool
+  return n * sizeof(float);
+}
+
+void unshare_parameters(Model& model){
+  size_t n = 0;
+  for (auto p : model.parameters_list()) n += p->values.d.size();
+  for (auto p : model.lookup_parameters_list()) n += p->all_values.d.size();
+  // kept until the process exits
+  float* v = new float[n];
+  for (auto p : model.parameters_list()){
+    unsigned sz = p->values.d.size();
+    memcpy(v, p->values.v, sz * sizeof(float));
+    p->values.v = v;
+    v += sz;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned sz = p->all_values.d.size();
+    memcpy(v, p->all_values.v, sz * sizeof(float));
+    p->all_values.v = v;
+    unsigned dim = p->dim.size();
+    for (unsigned i = 0; i < p->values.size(); i++)
+      p->values[i].v = v + i * dim;
+    v += sz;
+  }
+}
+
+TrainControl* new_train_control(unsigned nworkers){
+  size_t nbytes = sizeof(TrainControl) + nworkers * sizeof(WorkerStat);
+  TrainControl* ctrl = (TrainControl*)shared_alloc(nbytes);
+  ctrl->stop.store(0);
+  for (unsigned w = 0; w < nworkers; w++){
+    ctrl->stats[w].ndocs.store(0);
+    ctrl->stats[w].ntokens.store(0);
+    ctrl->stats[w].loss.store(0.0);
+  }
+  return ctrl;
+}
+
+void free_train_control(TrainControl* ctrl, unsigned nworkers){
+  shared_free(ctrl, sizeof(TrainControl) + nworkers * sizeof(WorkerStat));
+}
+
+// rows kept for a lookup parameter in a gradient slot
+static unsigned slot_rows(LookupParameterStorage* p, unsigned max_rows){
+  return min((unsigned)p->values.size(), max_rows);
+}
+
+size_t grad_slot_size(Model& model, unsigned max_rows){
+  size_t nbytes = 0;
+  for (auto p : model.parameters_list())
+    nbytes += p->g.d.size() * sizeof(float);
+  for (auto p : model.lookup_parameters_list()){
+    unsigned nrows = slot_rows(p, max_rows);
+    nbytes += sizeof(unsigned) * (nrows + 1);
+    nbytes += (size_t)nrows * p->dim.size() * sizeof(float);
+  }
+  return nbytes;
+}
+
+void pack_gradients(Model& model, char* slot, unsigned max_rows){
+  for (auto p : model.parameters_list()){
+    size_t nbytes = p->g.d.size() * sizeof(float);
+    memcpy(slot, p->g.v, nbytes);
+    slot += nbytes;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned nrows = slot_rows(p, max_rows);
+    if (p->non_zero_grads.size() > nrows){
+      cerr << "Too many rows (" << p->non_zero_grads.size()
+	   << ") in the gradient of a lookup parameter" << endl;
+      exit(1);
+    }
+    unsigned* header = (unsigned*)slot;
+    float* rows = (float*)(header + nrows + 1);
+    unsigned dim = p->dim.size();
+    header[0] = p->non_zero_grads.size();
+    unsigned k = 0;
+    for (auto idx : p->non_zero_grads){
+      header[k+1] = idx;
+      memcpy(rows + (size_t)k * dim, p->grads[idx].v, dim * sizeof(float));
+      k ++;
+    }
+    slot += sizeof(unsigned) * (nrows + 1) + (size_t)nrows * dim * sizeof(float);
+  }
+}
+
+void add_gradients(Model& model, const char* slot, unsigned max_rows){
+  for (auto p : model.parameters_list()){
+    unsigned sz = p->g.d.size();
+    const float* g = (const float*)slot;
+    for (unsigned i = 0; i < sz; i++) p->g.v[i] += g[i];
+    slot += sz * sizeof(float);
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned nrows = slot_rows(p, max_rows);
+    const unsigned* header = (const unsigned*)slot;
+    const float* rows = (const float*)(header + nrows + 1);
+    unsigned dim = p->dim.size();
+    for (unsigned k = 0; k < header[0]; k++){
+      unsigned idx = header[k+1];
+      float* g = p->grads[idx].v;
+      for (unsigned i = 0; i < dim; i++) g[i] += rows[(size_t)k * dim + i];
+      p->non_zero_grads.insert(idx);
+    }
+    slot += sizeof(unsigned) * (nrows + 1) + (size_t)nrows * dim * sizeof(float);
+  }
+}
+
+size_t value_slot_size(Model& model){
+  size_t n = 0;
+  for (auto p : model.parameters_list()) n += p->values.d.size();
+  for (auto p : model.lookup_parameters_list()) n += p->all_values.d.size();
+  return n * sizeof(float);
+}
+
+void pack_values(Model& model, float* slot){
+  for (auto p : model.parameters_list()){
+    unsigned sz = p->values.d.size();
+    memcpy(slot, p->values.v, sz * sizeof(float));
+    slot += sz;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned sz = p->all_values.d.size();
+    memcpy(slot, p->all_values.v, sz * sizeof(float));
+    slot += sz;
+  }
+}
+
+void unpack_values(Model& model, const float* slot){
+  for (auto p : model.parameters_list()){
+    unsigned sz = p->values.d.size();
+    memcpy(p->values.v, slot, sz * sizeof(float));
+    slot += sz;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned sz = p->all_values.d.size();
+    memcpy(p->all_values.v, slot, sz * sizeof(float));
+    slot += sz;
+  }
+}
+
+// v = (v + sum of slots) / (1 + number of slots)
+static void average_array(float* v, size_t sz, const vector<const float*>& slots,
+			  size_t offset){
+  float scale = 1.0 / (1 + slots.size());
+  for (size_t i = 0; i < sz; i++){
+    float sum = v[i];
+    for (auto slot : slots) sum += slot[offset + i];
+    v[i] = sum * scale;
+  }
+}
+
+void average_values(Model& model, const vector<const float*>& slots){
+  size_t offset = 0;
+  for (auto p : model.parameters_list()){
+    unsigned sz = p->values.d.size();
+    average_array(p->values.v, sz, slots, offset);
+    offset += sz;
+  }
+  for (auto p : model.lookup_parameters_list()){
+    unsigned sz = p->all_values.d.size();
+    average_array(p->all_values.v, sz, slots, offset);
+    offset += sz;
+  }
+}
@@ -0,0 +1,102 @@
+// parallel.h
+// Date: Oct. 17, 2026
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "dynet/model.h"
+
+#include <atomic>
+#include <vector>
+#include <functional>
+
+#include <sys/types.h>
+
+using namespace std;
+using namespace dynet;
+
+// DyNet allows only one ComputationGraph per process, so
+// parallel work is done by forked worker processes. A worker
+// talks to its parent through a pair of pipes
+struct Worker{
+  pid_t pid;
+  int to_fd; // parent -> worker
+  int from_fd; // worker -> parent
+};
+
+// fork a worker running fn(in_fd, out_fd); it exits when fn returns
+Worker fork_worker(function<void(int, int)> fn);
+
+// close the pipes and wait for the worker to exit
+int wait_worker(Worker& worker);
+
+// true if the worker has written something or exited, without
+// blocking
+bool worker_ready(const Worker& worker);
+
+// read/write exactly n bytes, false on error or EOF
+bool read_all(int fd, void* buf, size_t n);
+
+bool write_all(int fd, const void* buf, size_t n);
+
+// anonymous memory shared with workers forked afterwards
+void* shared_alloc(size_t nbytes);
+
+void shared_free(void* addr, size_t nbytes);
+
+// move the parameter values of a model into shared memory, so
+// all workers forked afterwards read and update the same copy
+size_t share_parameters(Model& model);
+
+// give this process its own copy of values moved by
+// share_parameters, e.g. for a forked evaluation that needs a
+// snapshot while training goes on
+void unshare_parameters(Model& model);
+
+// progress of a training worker, written by the worker only
+struct WorkerStat{
+  atomic<unsigned long> ndocs;
+  atomic<unsigned long> ntokens;
+  atomic<double> loss;
+};
+
+// control block shared by the async training workers
+struct TrainControl{
+  atomic<int> stop;
+  WorkerStat stats[1]; // one per worker, allocated with the block
+};
+
+TrainControl* new_train_control(unsigned nworkers);
+
+void free_train_control(TrainControl* ctrl, unsigned nworkers);
+
+// *******************************************************
+// gradient slots
+//
+// A slot holds the gradients of one worker: all dense
+// parameters, then for each lookup parameter up to
+// max_rows non-zero rows with their indices
+// *******************************************************
+size_t grad_slot_size(Model& model, unsigned max_rows);
+
+void pack_gradients(Model& model, char* slot, unsigned max_rows);
+
+void add_gradients(Model& model, const char* slot, unsigned max_rows);
+
+// *******************************************************
+// parameter averaging
+//
+// A value slot holds the values of all parameters of one
+// worker: dense ones first, then lookup ones
+// *******************************************************
+size_t value_slot_size(Model& model);
+
+void pack_values(Model& model, float* slot);
+
+void unpack_values(Model& model, const float* slot);
+
+// the values of the model become the mean of its own and
+// those in slots
+void average_values(Model& model, const vector<const float*>& slots);
+
+#endif
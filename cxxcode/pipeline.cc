@@ -0,0 +1,86 @@
+// pipeline.cc
+// Date: Oct. 17, 2026
+
+#include "pipeline.h"
+
+// docs leaving the buffer are cut into batches this many
+// batches at a time, so length bucketing has some docs to
+// choose from
+static const unsigned STAGE_BATCHES = 16;
+
+DocStream::DocStream(const string& fname, dynet::Dict* dptr, unsigned bufsize,
+		     unsigned batchsize, bool b_bucket, unsigned nqueue, unsigned seed):
+  fname(fname), dptr(dptr), bufsize(max(bufsize, (unsigned)1)),
+  batchsize(max(batchsize, (unsigned)1)), nqueue(max(nqueue, (unsigned)1)),
+  seed(seed), b_bucket(b_bucket), b_stop(false){
+  reader = thread([this](){ run(); });
+}
+
+DocStream::~DocStream(){
+  {
+    lock_guard<mutex> lock(mtx);
+    b_stop.store(true);
+  }
+  cv_push.notify_all();
+  if (reader.joinable()) reader.join();
+}
+
+Corpus DocStream::next(){
+  unique_lock<mutex> lock(mtx);
+  cv_pop.wait(lock, [this](){ return !queue.empty(); });
+  Corpus batch = move(queue.front());
+  queue.pop_front();
+  cv_push.notify_one();
+  return batch;
+}
+
+bool DocStream::push_batches(const Corpus& staging, mt19937& rng){
+  for (auto& idx : make_batches(staging, batchsize, b_bucket, rng)){
+    Corpus batch;
+    for (auto i : idx) batch.add_doc(staging[i]);
+    unique_lock<mutex> lock(mtx);
+    cv_push.wait(lock, [this](){ return b_stop.load() or (queue.size() < nqueue); });
+    if (b_stop.load()) return false;
+    queue.push_back(move(batch));
+    cv_pop.notify_one();
+  }
+  return true;
+}
+
+void DocStream::run(){
+  mt19937 rng(seed);
+  // one doc per corpus, so a doc can be swapped out alone
+  vector<Corpus> buffer;
+  buffer.reserve(bufsize);
+  Corpus doc, staging;
+  while (!b_stop.load()){
+    CorpusReader in(fname, dptr);
+    size_t ndocs = 0;
+    while ((!b_stop.load()) and in.next(doc)){
+      ndocs ++;
+      if (buffer.size() < bufsize){
+	buffer.push_back(move(doc));
+	doc = Corpus();
+	continue;
+      }
+      swap(buffer[rng() % bufsize], doc);
+      staging.add_doc(doc[0]);
+      doc.clear();
+      if (staging.size() < batchsize * STAGE_BATCHES) continue;
+      if (!push_batches(staging, rng)) return;
+      staging.clear();
+    }
+    if ((ndocs == 0) and (!b_stop.load())){
+      cerr << "No docs in " << fname << endl;
+      exit(1);
+    }
+    if ((!b_stop.load()) and (buffer.size() < bufsize)){
+      // the buffer is only filled in the first pass; a file
+      // smaller than the buffer is shuffled whole, and the
+      // next passes swap docs with it
+      cerr << "Shuffle buffer of " << bufsize << " docs cut to the "
+	   << buffer.size() << " docs of " << fname << endl;
+      bufsize = buffer.size();
+    }
+  }
+}
@@ -0,0 +1,54 @@
+// pipeline.h
+// Date: Oct. 17, 2026
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "util.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// *******************************************************
+// Training input pipeline
+//
+// A reader thread streams the docs of a training file (text
+// or compiled) pass after pass through a shuffle buffer of
+// bufsize docs (at most the docs of the file): each doc
+// read takes the place of a random one in the buffer, which
+// goes on to the trainer. The docs are parsed and their
+// trees scheduled in the reader, and up to nqueue batches
+// are kept ready ahead of the trainer. Memory is bounded by
+// the buffer and the queue, not by the size of the file
+// *******************************************************
+class DocStream{
+public:
+  DocStream(const string& fname, dynet::Dict* dptr, unsigned bufsize,
+	    unsigned batchsize, bool b_bucket, unsigned nqueue, unsigned seed);
+  ~DocStream();
+  // the next batch, as a corpus of its own; the file is read
+  // again and again, so there is always one
+  Corpus next();
+
+private:
+  string fname;
+  dynet::Dict* dptr;
+  unsigned bufsize, batchsize, nqueue, seed;
+  bool b_bucket;
+  mutex mtx;
+  condition_variable cv_push, cv_pop;
+  deque<Corpus> queue;
+  atomic<bool> b_stop;
+  thread reader;
+  void run();
+  // cut the staged docs into batches and queue them, false
+  // once the stream is stopped
+  bool push_batches(const Corpus& staging, mt19937& rng);
+};
+
+#endif
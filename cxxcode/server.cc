@@ -0,0 +1,229 @@
+// server.cc
+// Date: Oct. 17, 2026
+
+#include "server.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef chrono::steady_clock Clock;
+
+static volatile sig_atomic_t b_stop = 0;
+
+static void on_signal(int){ b_stop = 1; }
+
+// a connection: a socket, or stdin/stdout
+struct Client{
+  Client(int in_fd, int out_fd, dynet::Dict* dptr, unsigned nrela):
+    in_fd(in_fd), out_fd(out_fd), parser(dptr, false, true, nrela) {}
+  int in_fd, out_fd;
+  string buf; // the last partial line
+  DocParser parser;
+  bool b_eof = false; // no more requests
+  bool b_broken = false; // replies cannot be written
+  unsigned npending = 0;
+};
+
+struct Request{
+  unsigned cid;
+  Corpus doc; // the doc alone
+  string error; // a malformed doc, not scored
+  Clock::time_point arrival;
+};
+
+static double elapsed_ms(Clock::time_point from, Clock::time_point to){
+  return chrono::duration<double, milli>(to - from).count();
+}
+
+// latency percentiles and throughput since the last report
+static void report(vector<double>& latency, Clock::time_point& since,
+		   unsigned long total){
+  if (latency.size() == 0) return;
+  auto now = Clock::now();
+  sort(latency.begin(), latency.end());
+  unsigned n = latency.size();
+  double p50 = latency[n / 2];
+  double p99 = latency[min(n - 1, n * 99 / 100)];
+  double secs = elapsed_ms(since, now) / 1000.0;
+  cerr << "Served " << total << " docs; last " << n
+       << ": p50 = " << p50 << " ms, p99 = " << p99 << " ms, "
+       << (secs > 0 ? n / secs : 0.0) << " docs/s" << endl;
+  latency.clear();
+  since = now;
+}
+
+static int listen_socket(const string& fname){
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (fname.size() >= sizeof(addr.sun_path)){
+    cerr << "Socket path is too long: " << fname << endl;
+    return -1;
+  }
+  strncpy(addr.sun_path, fname.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(fname.c_str());
+  if ((fd < 0) or (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+      or (listen(fd, 16) != 0)){
+    cerr << "Cannot listen on " << fname << ": " << strerror(errno) << endl;
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int serve(dynet::Dict* dptr, const ServerOptions& opts,
+	  BatchHandler handler){
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN); // a client may go away any time
+  unsigned maxbatch = max(opts.maxbatch, (unsigned)1);
+  map<unsigned, unique_ptr<Client>> clients;
+  unsigned next_cid = 0;
+  int lfd = -1;
+  if (opts.socket.size() == 0){
+    clients[next_cid++].reset(new Client(0, 1, dptr, opts.nrela));
+  } else {
+    if ((lfd = listen_socket(opts.socket)) < 0) return 1;
+    cerr << "Listening on " << opts.socket << endl;
+  }
+  vector<Request> pending;
+  vector<double> latency;
+  unsigned long total = 0;
+  Clock::time_point since = Clock::now();
+  char chunk[65536];
+  while (!b_stop){
+    // drop the clients that are done
+    for (auto it = clients.begin(); it != clients.end(); ){
+      Client& c = *(it->second);
+      if ((c.b_eof or c.b_broken) and (c.npending == 0)){
+	close(c.in_fd);
+	if (c.out_fd != c.in_fd) close(c.out_fd);
+	it = clients.erase(it);
+      } else {
+	++ it;
+      }
+    }
+    // stdin is closed and every reply is sent
+    if ((lfd < 0) and clients.empty()) break;
+    // wait for new requests, or until the first pending doc
+    // has waited for batchwait ms
+    int timeout = -1;
+    if (pending.size() > 0){
+      double waited = elapsed_ms(pending[0].arrival, Clock::now());
+      timeout = max(0, (int)(opts.batchwait - waited));
+    }
+    vector<pollfd> fds;
+    vector<unsigned> cids;
+    if (lfd >= 0) fds.push_back({lfd, POLLIN, 0});
+    for (auto& kv : clients){
+      if (kv.second->b_eof) continue;
+      fds.push_back({kv.second->in_fd, POLLIN, 0});
+      cids.push_back(kv.first);
+    }
+    int nready = poll(fds.data(), fds.size(), timeout);
+    if ((nready < 0) and (errno != EINTR)){
+      cerr << "Server poll error: " << strerror(errno) << endl;
+      break;
+    }
+    unsigned first = 0;
+    if (lfd >= 0){
+      if ((nready > 0) and (fds[0].revents & POLLIN)){
+	int cfd = accept(lfd, nullptr, nullptr);
+	if (cfd >= 0) clients[next_cid++].reset(new Client(cfd, cfd, dptr, opts.nrela));
+      }
+      first = 1;
+    }
+    for (unsigned i = 0; (nready > 0) and (i < cids.size()); i++){
+      if (!(fds[first + i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      Client& c = *clients[cids[i]];
+      Request req;
+      ssize_t n = read(c.in_fd, chunk, sizeof(chunk));
+      if (n <= 0){
+	// end of requests; the last doc may miss its '=' line
+	c.b_eof = true;
+	c.buf.clear();
+	if (c.parser.flush(req.doc)){
+	  req.error = c.parser.error();
+	  req.cid = cids[i];
+	  req.arrival = Clock::now();
+	  pending.push_back(std::move(req));
+	  c.npending ++;
+	}
+	continue;
+      }
+      c.buf.append(chunk, n);
+      size_t start = 0, pos;
+      while ((pos = c.buf.find('\n', start)) != string::npos){
+	string line = c.buf.substr(start, pos - start);
+	if ((line.size() > 0) and (line.back() == '\r')) line.pop_back();
+	start = pos + 1;
+	if (c.parser.add_line(line, req.doc)){
+	  req.error = c.parser.error();
+	  req.cid = cids[i];
+	  req.arrival = Clock::now();
+	  pending.push_back(std::move(req));
+	  req = Request();
+	  c.npending ++;
+	}
+      }
+      c.buf.erase(0, start);
+    }
+    // score when a batch is full, when the first doc has
+    // waited long enough, or when no more docs can come
+    bool b_flush = b_stop or ((lfd < 0) and (pending.size() > 0)
+			      and clients.begin()->second->b_eof);
+    while ((pending.size() >= maxbatch)
+	   or ((pending.size() > 0)
+	       and (b_flush or (elapsed_ms(pending[0].arrival, Clock::now())
+				>= opts.batchwait)))){
+      unsigned n = min((unsigned)pending.size(), maxbatch);
+      // a malformed doc is answered with an error line, in
+      // its place among the replies of its connection
+      vector<const Doc*> docs;
+      for (unsigned k = 0; k < n; k++)
+	if (pending[k].error.empty()) docs.push_back(&pending[k].doc[0]);
+      vector<string> replies;
+      if (docs.size() > 0) handler(docs, replies);
+      Clock::time_point now = Clock::now();
+      unsigned r = 0;
+      for (unsigned k = 0; k < n; k++){
+	Client& c = *clients[pending[k].cid];
+	c.npending --;
+	string out;
+	if (pending[k].error.empty()) out = replies[r++] + "\n";
+	else out = "ERROR\t" + pending[k].error + "\n";
+	if (!c.b_broken){
+	  if (!write_all(c.out_fd, out.data(), out.size())) c.b_broken = true;
+	}
+	// throughput is counted from the first doc of a report
+	if (latency.size() == 0) since = pending[k].arrival;
+	latency.push_back(elapsed_ms(pending[k].arrival, now));
+	total ++;
+	if ((opts.reportfreq > 0) and (latency.size() >= opts.reportfreq))
+	  report(latency, since, total);
+      }
+      pending.erase(pending.begin(), pending.begin() + n);
+    }
+  }
+  report(latency, since, total);
+  for (auto& kv : clients){
+    close(kv.second->in_fd);
+    if (kv.second->out_fd != kv.second->in_fd) close(kv.second->out_fd);
+  }
+  if (lfd >= 0){
+    close(lfd);
+    unlink(opts.socket.c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,37 @@
+// server.h
+// Date: Oct. 17, 2026
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "util.h"
+
+#include <functional>
+
+using namespace std;
+
+// *******************************************************
+// Inference server
+//
+// Requests are docs in the corpus format (EDU lines ended
+// by a "=\tfilename\tlabel" line), read from a Unix socket
+// or from stdin. Docs that arrive within batchwait ms are
+// scored together, at most maxbatch at a time, and each
+// doc gets one reply line on its connection; a malformed
+// doc gets "ERROR\t<reason>" and the server keeps going
+// *******************************************************
+struct ServerOptions{
+  string socket; // stdin/stdout if empty
+  unsigned maxbatch;
+  unsigned batchwait; // in ms
+  unsigned reportfreq; // report latency every reportfreq docs
+  unsigned nrela; // relations of the model, larger indices are rejected
+};
+
+// score a batch of docs, one reply line (without '\n') for each
+typedef function<void(const vector<const Doc*>&, vector<string>&)> BatchHandler;
+
+int serve(dynet::Dict* dptr, const ServerOptions& opts,
+	  BatchHandler handler);
+
+#endif
@@ -0,0 +1,125 @@
+// sparse.cc
+// Date: Oct. 17, 2026
+
+#include "sparse.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+static float trainer_eps(unsigned trainer, const TrainerParams& params){
+  if (params.eps > 0) return params.eps;
+  return (trainer == 1) ? 1e-20 : 1e-8;
+}
+
+Trainer* new_trainer(Model& model, unsigned trainer, float lr,
+		     const TrainerParams& params){
+  float eps = trainer_eps(trainer, params);
+  if (trainer == 0) return new SimpleSGDTrainer(model, lr);
+  if (trainer == 1) return new AdagradTrainer(model, lr, eps);
+  if (trainer == 2) return new AdamTrainer(model, lr, params.beta1, params.beta2, eps);
+  return nullptr;
+}
+
+SparseUpdater::SparseUpdater(Model& model, Trainer* sgd, unsigned trainer,
+			     const TrainerParams& params):
+  model(model), sgd(sgd), trainer(trainer), t(0), beta1(params.beta1),
+  beta2(params.beta2), eps(trainer_eps(trainer, params)){
+  if (trainer > 2){
+    cerr << "Sparse updates need trainer 0, 1 or 2" << endl;
+    exit(1);
+  }
+  b_clip = sgd->clipping_enabled;
+  clip_threshold = sgd->clip_threshold;
+  for (auto p : model.lookup_parameters_list()){
+    LookupState s;
+    s.p = p;
+    size_t n = (size_t)p->values.size() * p->dim.size();
+    if (trainer >= 1) s.v.assign(n, 0);
+    if (trainer == 2){
+      s.m.assign(n, 0);
+      s.last.assign(p->values.size(), 0);
+    }
+    states.push_back(s);
+  }
+  for (auto p : model.parameters_list()){
+    DenseState s;
+    s.p = p;
+    size_t n = p->values.d.size();
+    if (trainer >= 1) s.v.assign(n, 0);
+    if (trainer == 2) s.m.assign(n, 0);
+    dense.push_back(s);
+  }
+}
+
+void SparseUpdater::step(float* x, float* g, float* m, float* v, unsigned n,
+			 unsigned missed, float gscale){
+  float eta = sgd->eta;
+  if (trainer == 0){
+    for (unsigned i = 0; i < n; i++) x[i] -= eta * gscale * g[i];
+  } else if (trainer == 1){
+    for (unsigned i = 0; i < n; i++){
+      float gi = gscale * g[i];
+      v[i] += gi * gi;
+      x[i] -= eta * gi / sqrt(v[i] + eps);
+    }
+  } else {
+    // the missed updates had zero gradients
+    float d1 = beta1, d2 = beta2;
+    if (missed > 0){
+      d1 *= pow(beta1, (float)missed);
+      d2 *= pow(beta2, (float)missed);
+    }
+    float lr = eta * sqrt(1 - pow(beta2, (float)t)) / (1 - pow(beta1, (float)t));
+    for (unsigned i = 0; i < n; i++){
+      float gi = gscale * g[i];
+      m[i] = d1 * m[i] + (1 - beta1) * gi;
+      v[i] = d2 * v[i] + (1 - beta2) * gi * gi;
+      x[i] -= lr * m[i] / (sqrt(v[i]) + eps);
+    }
+  }
+  memset(g, 0, n * sizeof(float));
+}
+
+void SparseUpdater::update(float scale){
+  t ++;
+  float gscale = 1;
+  if (b_clip){
+    double gg = 0;
+    for (auto p : model.parameters_list()){
+      const float* g = p->g.v;
+      for (unsigned i = 0; i < p->g.d.size(); i++) gg += g[i] * g[i];
+    }
+    for (auto& s : states){
+      unsigned dim = s.p->dim.size();
+      for (auto idx : s.p->non_zero_grads){
+	const float* g = s.p->grads[idx].v;
+	for (unsigned i = 0; i < dim; i++) gg += g[i] * g[i];
+      }
+    }
+    gg = sqrt(gg);
+    if (std::isnan(gg) or std::isinf(gg)){
+      cerr << "Magnitude of gradient is bad: " << gg << endl;
+      exit(1);
+    }
+    if (scale * gg > clip_threshold) gscale = clip_threshold / (scale * gg);
+  }
+  gscale *= scale;
+  for (auto& s : dense){
+    unsigned n = s.p->values.d.size();
+    step(s.p->values.v, s.p->g.v, s.m.empty() ? nullptr : s.m.data(),
+	 s.v.empty() ? nullptr : s.v.data(), n, 0, gscale);
+  }
+  for (auto& s : states){
+    unsigned dim = s.p->dim.size();
+    for (auto idx : s.p->non_zero_grads){
+      size_t off = (size_t)idx * dim;
+      unsigned missed = (trainer == 2) ? t - s.last[idx] - 1 : 0;
+      step(s.p->values[idx].v, s.p->grads[idx].v, s.m.empty() ? nullptr : s.m.data() + off,
+	   s.v.empty() ? nullptr : s.v.data() + off, dim, missed, gscale);
+      if (trainer == 2) s.last[idx] = t;
+    }
+    s.p->non_zero_grads.clear();
+  }
+}
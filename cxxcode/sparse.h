@@ -0,0 +1,79 @@
+// sparse.h
+// Date: Oct. 17, 2026
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "dynet/model.h"
+#include "dynet/training.h"
+
+#include <vector>
+
+using namespace std;
+using namespace dynet;
+
+// the constants of Adagrad (eps) and Adam (beta1, beta2,
+// eps), given to the DyNet trainer and to SparseUpdater
+// alike; eps 0 is the default of the trainer (1e-20 for
+// Adagrad, 1e-8 for Adam)
+struct TrainerParams{
+  float beta1 = 0.9;
+  float beta2 = 0.999;
+  float eps = 0;
+};
+
+// trainer as --trainer: 0 (SGD), 1 (Adagrad), 2 (Adam);
+// nullptr for the others
+Trainer* new_trainer(Model& model, unsigned trainer, float lr,
+		     const TrainerParams& params);
+
+// *******************************************************
+// Sparse updates of lookup parameters
+//
+// Updates the model in place of a DyNet trainer: only the
+// rows of the lookup parameters (word embeddings, relation
+// matrices) looked up since the last update are touched, so
+// the cost of an update follows the number of tokens, not
+// the vocab size. The moment estimates of a row are decayed
+// when it is next used, by the number of updates it missed;
+// the moves its old moments would have made in between are
+// skipped (lazy Adam). The dense parameters get the plain
+// update of the trainer. The trainer itself only keeps the
+// learning rate schedule and the clipping options; its
+// update is never called, so it allocates no moments
+// *******************************************************
+class SparseUpdater{
+public:
+  SparseUpdater(Model& model, Trainer* sgd, unsigned trainer,
+		const TrainerParams& params);
+  // in place of sgd->update(scale)
+  void update(float scale = 1.0);
+
+private:
+  // optimizer state of one lookup parameter, a row per word
+  struct LookupState{
+    LookupParameterStorage* p;
+    vector<float> m, v; // Adam: first/second moments; Adagrad: v only
+    vector<unsigned> last; // Adam: update of the last use
+  };
+  // optimizer state of one dense parameter
+  struct DenseState{
+    ParameterStorage* p;
+    vector<float> m, v;
+  };
+  Model& model;
+  Trainer* sgd;
+  unsigned trainer;
+  bool b_clip;
+  float clip_threshold;
+  unsigned t; // number of updates
+  float beta1, beta2, eps;
+  vector<LookupState> states;
+  vector<DenseState> dense;
+  // one step on n values, whose moments missed the last
+  // missed updates
+  void step(float* x, float* g, float* m, float* v, unsigned n,
+	    unsigned missed, float gscale);
+};
+
+#endif
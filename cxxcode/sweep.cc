@@ -0,0 +1,74 @@
+// sweep.cc
+// Date: Oct. 17, 2026
+
+#include "sweep.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+string SweepConfig::name() const{
+  ostringstream os;
+  os << "arch" << arch << "-in" << inputdim << "-hid" << hiddendim
+     << "-layer" << nlayer << "-tr" << trainer << "-lr" << lr
+     << "-drop" << droprate;
+  return os.str();
+}
+
+// set one option of a config from its text value, false if
+// the option is unknown
+static bool set_option(SweepConfig& cfg, const string& key, const string& value){
+  if (key == "arch") cfg.arch = stoul(value);
+  else if (key == "inputdim") cfg.inputdim = stoul(value);
+  else if (key == "hiddendim") cfg.hiddendim = stoul(value);
+  else if (key == "nlayer") cfg.nlayer = stoul(value);
+  else if (key == "trainer") cfg.trainer = stoul(value);
+  else if (key == "lr") cfg.lr = stof(value);
+  else if (key == "droprate") cfg.droprate = stof(value);
+  else return false;
+  return true;
+}
+
+vector<SweepConfig> read_sweep_grid(const string& fname, const SweepConfig& base){
+  ifstream in(fname);
+  if (!in.good()){
+    cerr << "Cannot open " << fname << endl;
+    exit(1);
+  }
+  vector<SweepConfig> configs(1, base);
+  string line;
+  while (getline(in, line)){
+    line = line.substr(0, line.find('#'));
+    istringstream is(line);
+    string key, value;
+    if (!(is >> key)) continue;
+    vector<string> values;
+    while (is >> value) values.push_back(value);
+    if (values.empty()){
+      cerr << "No values for " << key << " in " << fname << endl;
+      exit(1);
+    }
+    // every config so far, with each value of this option
+    vector<SweepConfig> grid;
+    for (auto& cfg : configs){
+      for (auto& v : values){
+	SweepConfig next = cfg;
+	bool b_ok = false;
+	try {
+	  b_ok = set_option(next, key, v);
+	} catch (const exception&){
+	  cerr << "Wrong value " << v << " for " << key << " in " << fname << endl;
+	  exit(1);
+	}
+	if (!b_ok){
+	  cerr << "Unknown option " << key << " in " << fname << endl;
+	  exit(1);
+	}
+	grid.push_back(next);
+      }
+    }
+    configs.swap(grid);
+  }
+  return configs;
+}
@@ -0,0 +1,40 @@
+// sweep.h
+// Date: Oct. 17, 2026
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// *******************************************************
+// Hyperparameter sweep
+//
+// A grid file has one line per varied option, the option
+// name followed by its values, e.g.
+//
+//   lr 0.1 0.01
+//   hiddendim 32 64
+//
+// with '#' starting a comment. The options are arch,
+// inputdim, hiddendim, nlayer, trainer, lr and droprate;
+// those not in the file keep their command-line values. The
+// sweep goes over all combinations of the values
+// *******************************************************
+struct SweepConfig{
+  unsigned arch;
+  unsigned inputdim;
+  unsigned hiddendim;
+  unsigned nlayer;
+  unsigned trainer;
+  float lr;
+  float droprate;
+  // e.g. arch0-in16-hid32-layer1-tr0-lr0.1-drop0
+  string name() const;
+};
+
+vector<SweepConfig> read_sweep_grid(const string& fname, const SweepConfig& base);
+
+#endif
@@ -15,10 +15,12 @@
 #include "dynet/lstm.h"
 #include "dynet/dict.h"
 #include "dynet/expr.h"
-#include "dynet/pretrain.h"
 
 #include "util.h"
+#include "educache.h"
+#include "infer.h"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -37,7 +39,7 @@ dynet::Dict d;
 
 template <class Builder>
 struct TextClass {
-  LookupParameter p_W; // word embeddings
+  LookupParameter p_W; // word embeddings, without pretrained ones
   // LookupParameter p_Ua; // relation specific attention weight
   Parameter p_Ua; // attention weight
   LookupParameter p_Ut; // relation-specific composition function
@@ -46,14 +48,17 @@ struct TextClass {
   // Builder docbuilder; // builder for the doc structure
   Builder fw_senbuilder; // builder for the forward sent rep
   Builder bw_senbuilder; // builder for the backward sent rep
-  unordered_map<int, vector<float>> embeddings; // word embeddings
+  const float* embed_table; // pretrained embeddings, never trained or saved
+  unsigned embed_dim, embed_size; // of embed_table
   bool b_pretrained; // whether use pretrained word embeddings
   unsigned march; // model architecture
+  unsigned rep_dim; // dimension of EDU reps
+  EduCache* edu_cache; // EDU reps for inference, not owned
 
 public:
   TextClass(Model& model, unsigned input_dim, unsigned hidden_dim, unsigned nlayer,
 	    unsigned nclass, unsigned nrela, unsigned vocab_size,
-	    Dict& d, const string fembed, const unsigned model_arch) {
+	    Dict& d, const float* embed, const unsigned model_arch) {
     /********************************************************************
      * model: dynet model
      * input_dim: input dimension
@@ -63,11 +68,19 @@ public:
      * nrela: number of discourse relations
      * vocab_size: vocab size
      * d: dynet dictionary
-     * fembed: word embedding file
+     * embed: pretrained word embeddings from load_embedding_table,
+     *        vocab_size x input_dim, or nullptr
      * model_arch: model arch index (0: full model; 1: without comp mat; 
      *                               2: single edu)
      ********************************************************************/
-    p_W = model.add_lookup_parameters(vocab_size, {input_dim});
+    rep_dim = hidden_dim * 2;
+    // the pretrained table is read in place, it needs no
+    // parameters of its own
+    b_pretrained = (embed != nullptr);
+    embed_table = embed;
+    embed_dim = input_dim;
+    embed_size = vocab_size;
+    if (!b_pretrained) p_W = model.add_lookup_parameters(vocab_size, {input_dim});
     // p_Ua = model.add_lookup_parameters(nrela, {hidden_dim*4});
     p_Ua = model.add_parameters({hidden_dim*2, hidden_dim*2});
     p_Ut = model.add_lookup_parameters(nrela, {hidden_dim*2, hidden_dim*2});
@@ -76,15 +89,8 @@ public:
     // docbuilder = Builder(nlayer, hidden_dim*2, hidden_dim*2, model);
     fw_senbuilder = Builder(nlayer, input_dim, hidden_dim, model);
     bw_senbuilder = Builder(nlayer, input_dim, hidden_dim, model);
-    if (fembed.size() > 0){
-      read_pretrained_embeddings(fembed, d, embeddings);
-      b_pretrained = true;
-      cerr << "Load " << embeddings.size() << " word embeddings with dim:" << embeddings[0].size() << endl;
-      assert(embeddings[0].size() == input_dim);
-    } else {
-      b_pretrained = false;
-    }
     march = model_arch;
+    edu_cache = nullptr;
     if ((march > 4) or (march < 0)){
       cerr << "Unrecognized model architecture index: " << march << endl;
       exit(1);
@@ -92,186 +98,433 @@ public:
   }
 
   // main function to build a CG
-  Expression build_model(Doc&, ComputationGraph&, float, bool, Record&);
+  Expression build_model(const Doc&, ComputationGraph&, float, bool,
+			 bool b_record = false);
+
+  // build a CG for a batch of docs, one expression per doc
+  vector<Expression> build_model(const vector<const Doc*>&, ComputationGraph&,
+				 float, bool, bool b_record = false);
+
+  // attention weights of the docs given to the last build_model
+  // call with b_record, only valid after the forward pass
+  void read_record(Record&);
+  void read_records(vector<Record>&);
+
+  // reuse the reps of EDUs seen before; inference only
+  void set_edu_cache(EduCache* cache) { edu_cache = cache; }
+
+  // store the EDU reps computed by the last build_model call
+  // in the cache, only valid after the forward pass
+  void cache_edus();
+
+  // the parameters for the native inference engine
+  InferSource infer_source();
 
 private:
-  // build sentence reps
-  vector<Expression> build_edus(const Doc&, ComputationGraph&, float, bool);
+  // build sentence reps of all docs in a batch
+  vector<vector<Expression>> build_edus(const vector<const Doc*>&,
+					ComputationGraph&, float, bool);
+
+  // word embeddings of a batch of tokens
+  Expression embed_words(const vector<unsigned>&, ComputationGraph&);
+
+  // compose the EDU reps of a batch of docs along their trees
+  void compose_tree(const vector<const Doc*>&, vector<vector<Expression>>&,
+		    ComputationGraph&, bool);
+
+  // attention weights of one tree level, kept by compose_tree
+  struct AttnTrace{
+    Expression alpha; // 1 x K
+    vector<unsigned> docs; // doc index of each weight
+    vector<int> pnodes;
+    vector<int> cnodes;
+  };
+  vector<AttnTrace> traces;
+  vector<const Doc*> trace_docs;
+
+  // EDUs missing from the cache, with their reps
+  vector<pair<EduView, Expression>> cache_pending;
   
 };
 
 template <class Builder>
-Expression TextClass<Builder>::build_model(Doc& doc,
+Expression TextClass<Builder>::build_model(const Doc& doc,
 					   ComputationGraph& cg,
 					   float dropout_rate,
 					   bool b_test,
-					   Record& record){
+					   bool b_record){
+  vector<Expression> outputs = build_model(vector<const Doc*>(1, &doc), cg,
+					   dropout_rate, b_test, b_record);
+  return outputs[0];
+}
+
+template <class Builder>
+vector<Expression> TextClass<Builder>::build_model(const vector<const Doc*>& docs,
+						   ComputationGraph& cg,
+						   float dropout_rate,
+						   bool b_test,
+						   bool b_record){
   // add builder-based expression to the graph
   bool b_dropout = ((dropout_rate > 0) and (!b_test));
-  Expression Ua = parameter(cg, p_Ua);
   // cerr << "whether dropout: " << b_dropout << endl;
   // network dropout
   // if (b_dropout) docbuilder.set_dropout(dropout_rate);
   // docbuilder.new_graph(cg); 
   // docbuilder.start_new_sequence();
-  // get all EDU representations
-  // cerr << "build sentence representations ..." << endl;
-  vector<Expression> edus = build_edus(doc, cg, dropout_rate, b_dropout);
-  // cerr << "number of EDUs: " << doc.edus.size() << endl;
-  // cerr << "edus.size(): " << edus.size() << endl;
+  // get all EDU representations, in one pass for the whole batch
+  vector<vector<Expression>> edus = build_edus(docs, cg, dropout_rate, b_dropout);
+  traces.clear();
+  trace_docs.clear();
+  if (b_record) trace_docs = docs;
   // build representation based tree structure
   // cerr << "build doc representation ..." << endl;
-  if (march <= 1){
-    for (auto& pidx : doc.order){
-      // int pidx = it->first; // parent node
-      vector<int> cnodes = doc.tree[pidx]; // a list of children nodes
-      if (cnodes.empty()) continue;
-      // cerr << "children nodes: ";
-      // print_int_vector(cnodes);
-      Expression comprep = edus[pidx]; // init comp node
-      for (auto cidx : cnodes){
-	// get relation index
-	int ridx = doc.relas[cidx];
-	// if (ridx >= 1) ridx = 1; // shrink the relation size for debug
-	// cerr << "relation index = " << ridx << endl;
-	// compute attention weight
-	// cerr << "compute attention weight" << endl;
-	// Expression alpha = logistic(transpose(lookup(cg, p_Ua, ridx)) * concatenate({edus[pidx], edus[cidx]}));
-	// bi-linear form attention weights
-	Expression alpha = logistic(transpose(edus[pidx]) * (Ua * edus[cidx]));
-	// keep record
-	pair<unsigned, float> rec;
-	rec.first = cidx;
-	rec.second = as_scalar(cg.incremental_forward(alpha));
-	record.push_back(rec);
-	// cerr << "weighting" << endl;
-	Expression weighted_rep;
-	if (march == 0){
-	  // with composition matrix (more parameters)
-	  weighted_rep = lookup(cg, p_Ut, ridx) * edus[cidx];
-	  // weighted_rep = lookup(cg, p_Ut, (unsigned)0) * edus[cidx];
-	  weighted_rep = weighted_rep * alpha;
-	} else {
-	  // no composition function
-	  weighted_rep = edus[cidx] * alpha;
-	}
-	// cerr << "adding" << endl;
-      comprep = comprep + weighted_rep;
-      }
-      // take compnode as input to the docbuilder
-      // and update the corresponding representation
-      // edus[pidx] = docbuilder.add_input(comprep);
-      edus[pidx] = tanh(comprep);
-    }
+  if ((march <= 1) or (march == 4)){
+    compose_tree(docs, edus, cg, b_record);
   } else if (march == 3){
     // bag-of-EDU model
-    for (unsigned eidx = 0; eidx < edus.size(); eidx ++){
-      if (eidx != doc.root)
-	edus[doc.root] = edus[doc.root] + edus[eidx];
-    }
-    // take average
-    edus[doc.root] = (edus[doc.root] / edus.size());
-  } else if (march == 4){ // standard attention
-    // cout << "Try standard attention weights ..." << endl;
-    for (auto& pidx : doc.order){
-      // get parent EDU rep
-      Expression comprep = edus[pidx];
-      // get all children nodes
-      vector<int> cnodes = doc.tree[pidx];
-      if (cnodes.size() > 0){
-	// if it's not empty
-	vector<Expression> cnodes_exps;
-	for (auto cidx : cnodes){
-	  cnodes_exps.push_back(edus[cidx]);
-	}
-	// attention weights
-	Expression alpha = softmax(transpose(concatenate_cols(cnodes_exps)) * (Ua * edus[pidx]));
-	// composition
-	for (unsigned iidx = 0; iidx < cnodes.size(); iidx++){
-	  Expression weighted_rep = cnodes_exps[iidx] * pick(alpha, iidx);
-	  comprep = comprep + weighted_rep;
-	}
+    for (unsigned k = 0; k < docs.size(); k++){
+      int root = docs[k]->root;
+      for (unsigned eidx = 0; eidx < edus[k].size(); eidx ++){
+	if ((int)eidx != root)
+	  edus[k][root] = edus[k][root] + edus[k][eidx];
       }
-      edus[pidx] = tanh(comprep);
+      // take average
+      edus[k][root] = (edus[k][root] / edus[k].size());
     }
   } else {
     // what?
     abort();
   }
-  // get root node
-  Expression root = edus[doc.root];
-  // output dropout
-  if (b_dropout) root = dropout(root, dropout_rate);
   // get classification parameters
   Expression Uc = parameter(cg, p_Uc);
   Expression bias = parameter(cg, p_bias);
-  // compuate the log-prob
-  Expression logit = (Uc * root) + bias;
-  if (b_test){
-    Expression prob = softmax(logit);
-    return prob;
-  } else {
-    Expression p_err = pickneglogsoftmax(logit, doc.label);
-    return p_err;
+  vector<Expression> outputs;
+  for (unsigned k = 0; k < docs.size(); k++){
+    // get root node
+    Expression root = edus[k][docs[k]->root];
+    // output dropout
+    if (b_dropout) root = dropout(root, dropout_rate);
+    // compuate the log-prob
+    Expression logit = (Uc * root) + bias;
+    if (b_test){
+      Expression prob = softmax(logit);
+      outputs.push_back(prob);
+    } else {
+      Expression p_err = pickneglogsoftmax(logit, docs[k]->label);
+      outputs.push_back(p_err);
+    }
+  }
+  return outputs;
+}
+
+/*******************************************************
+ * compose EDU reps along the trees, one level at a time
+ *
+ * All pnodes of the same height (over all docs in the
+ * batch) are independent, so each level is one step:
+ * their children are stacked as the columns of C, and
+ * the K x Np 0/1 matrix S maps each child to its pnode
+ * - arch 0/1: alpha_k = logistic(p^T Ua c_k)
+ * - arch 4: alpha = softmax over the children of each
+ *   pnode of c_k^T Ua p
+ * then p <- tanh(p + sum_k alpha_k (Ut[r_k]) c_k), where
+ * Ut[r_k] is only used in arch 0
+ *******************************************************/
+template <class Builder>
+void TextClass<Builder>::compose_tree(const vector<const Doc*>& docs,
+				      vector<vector<Expression>>& edus,
+				      ComputationGraph& cg,
+				      bool b_record){
+  Expression Ua = parameter(cg, p_Ua);
+  Expression ones_row = input(cg, Dim({1, rep_dim}), vector<float>(rep_dim, 1.0));
+  unsigned n_levels = 0;
+  for (auto doc : docs) n_levels = max(n_levels, doc->n_levels());
+  // leaves only go through tanh in arch 4
+  if (march == 4){
+    for (unsigned k = 0; k < docs.size(); k++){
+      if (docs[k]->n_levels() == 0) continue;
+      for (auto pidx : docs[k]->level(0))
+	edus[k][pidx] = tanh(edus[k][pidx]);
+    }
+  }
+  for (unsigned h = 1; h < n_levels; h++){
+    vector<pair<unsigned, int>> pnodes; // (doc index, pnode)
+    vector<unsigned> n_children;
+    vector<int> cnodes;
+    vector<Expression> preps, creps, pcreps; // pnodes, children, pnode of each child
+    vector<unsigned> ridxs;
+    for (unsigned k = 0; k < docs.size(); k++){
+      const Doc& doc = *docs[k];
+      if (h >= doc.n_levels()) continue;
+      for (auto pidx : doc.level(h)){
+	pnodes.push_back(make_pair(k, pidx));
+	preps.push_back(edus[k][pidx]);
+	NodeList children = doc.children(pidx);
+	n_children.push_back(children.size());
+	for (auto cidx : children){
+	  cnodes.push_back(cidx);
+	  creps.push_back(edus[k][cidx]);
+	  pcreps.push_back(edus[k][pidx]);
+	  ridxs.push_back(doc.rela(cidx));
+	}
+      }
+    }
+    unsigned n_par = pnodes.size(), n_child = cnodes.size();
+    // child-to-pnode map, column major
+    vector<float> sel(n_child * n_par, 0.0);
+    for (unsigned j = 0, c = 0; j < n_par; j++){
+      for (unsigned i = 0; i < n_children[j]; i++, c++) sel[j * n_child + c] = 1.0;
+    }
+    Expression S = input(cg, Dim({n_child, n_par}), sel);
+    Expression P = concatenate_cols(preps);
+    Expression C = concatenate_cols(creps);
+    Expression PC = concatenate_cols(pcreps);
+    // attention weights, 1 x K
+    Expression alpha;
+    if (march <= 1){
+      // bi-linear form attention weights
+      alpha = logistic(ones_row * cmult(PC, Ua * C));
+    } else {
+      // one softmax for the level: the scores of each pnode
+      // are padded to max_c with a large negative value and
+      // normalized as one batch element
+      Expression scores = transpose(ones_row * cmult(C, Ua * PC));
+      unsigned max_c = *max_element(n_children.begin(), n_children.end());
+      Expression ext = concatenate({scores, input(cg, (real)-1e30)});
+      vector<unsigned> pad(max_c * n_par, n_child), pos(n_child);
+      for (unsigned j = 0, c = 0; j < n_par; j++){
+	for (unsigned i = 0; i < n_children[j]; i++, c++){
+	  pad[j * max_c + i] = c;
+	  pos[c] = j * max_c + i;
+	}
+      }
+      Expression padded = reshape(select_rows(ext, pad), Dim({max_c}, n_par));
+      Expression probs = reshape(softmax(padded), Dim({max_c * n_par}));
+      alpha = transpose(select_rows(probs, pos));
+    }
+    // keep record, the values are read after the forward pass
+    if (b_record){
+      AttnTrace trace;
+      trace.alpha = alpha;
+      for (unsigned j = 0, c = 0; j < n_par; j++){
+	for (unsigned i = 0; i < n_children[j]; i++, c++){
+	  trace.docs.push_back(pnodes[j].first);
+	  trace.pnodes.push_back(pnodes[j].second);
+	  trace.cnodes.push_back(cnodes[c]);
+	}
+      }
+      traces.push_back(trace);
+    }
+    Expression T;
+    if (march == 0){
+      // with composition matrix (more parameters)
+      T = lookup(cg, p_Ut, ridxs) * concatenate_to_batch(creps);
+      T = reshape(T, Dim({rep_dim, n_child}));
+    } else {
+      // no composition function
+      T = C;
+    }
+    // weights of each child for its own pnode, K x Np
+    Expression A = cmult(S, transpose(alpha) * input(cg, Dim({1, n_par}), vector<float>(n_par, 1.0)));
+    // take compnode as input to the docbuilder
+    // and update the corresponding representation
+    Expression comprep = tanh(P + T * A);
+    for (unsigned j = 0; j < n_par; j++){
+      Expression& rep = edus[pnodes[j].first][pnodes[j].second];
+      rep = (n_par == 1) ? comprep : select_cols(comprep, {j});
+    }
+  }
+}
+
+template <class Builder>
+void TextClass<Builder>::read_record(Record& record){
+  vector<Record> records;
+  read_records(records);
+  record.clear();
+  if (records.size() > 0) record.swap(records[0]);
+}
+
+/*******************************************************
+ * collect the attention weights (child node, weight) of
+ * each doc, in the order of the pnodes in doc.order
+ *******************************************************/
+template <class Builder>
+void TextClass<Builder>::read_records(vector<Record>& records){
+  records.assign(trace_docs.size(), Record());
+  // weights with the rank of their pnode in doc.order
+  vector<vector<pair<unsigned, pair<unsigned, float>>>> ranked(trace_docs.size());
+  for (auto& trace : traces){
+    vector<float> values = as_vector(trace.alpha.value());
+    for (unsigned c = 0; c < values.size(); c++){
+      ranked[trace.docs[c]].push_back(make_pair(trace.pnodes[c], make_pair(trace.cnodes[c], values[c])));
+    }
+  }
+  for (unsigned k = 0; k < trace_docs.size(); k++){
+    if (ranked[k].empty()) continue;
+    NodeList order = trace_docs[k]->order();
+    vector<unsigned> rank(trace_docs[k]->n_edus(), 0);
+    for (unsigned i = 0; i < order.size(); i++) rank[order[i]] = i;
+    for (auto& item : ranked[k]) item.first = rank[item.first];
+    stable_sort(ranked[k].begin(), ranked[k].end(),
+		[](const pair<unsigned, pair<unsigned, float>>& a,
+		   const pair<unsigned, pair<unsigned, float>>& b){
+		  return a.first < b.first;});
+    for (auto& item : ranked[k]) records[k].push_back(item.second);
   }
 }
 
 /*******************************************************
- * build reps for all EDUs
+ * build reps for all EDUs of a batch of docs
+ *
+ * EDUs of the same length (from any doc) are encoded
+ * together as one batch of the LSTM builders, so no
+ * padding is needed and each EDU gets the same rep as if
+ * it was encoded alone
  *******************************************************/
 template <class Builder>
-vector<Expression> TextClass<Builder>::build_edus(const Doc& doc,
-						  ComputationGraph& cg,
-						  float dropout_rate,
-						  bool b_dropout){
+vector<vector<Expression>> TextClass<Builder>::build_edus(const vector<const Doc*>& docs,
+							  ComputationGraph& cg,
+							  float dropout_rate,
+							  bool b_dropout){
   if (b_dropout){
     fw_senbuilder.set_dropout(dropout_rate);
     bw_senbuilder.set_dropout(dropout_rate);
+  } else {
+    fw_senbuilder.disable_dropout();
+    bw_senbuilder.disable_dropout();
   }
   fw_senbuilder.new_graph(cg);
   bw_senbuilder.new_graph(cg);
-  vector<Edu> edus = doc.edus;
-  unsigned n_edus = edus.size();
-  vector<Expression> sent_reps;
-  for (unsigned idx = 0; idx < n_edus; idx++){
-    // for each sentence
+  // group EDUs by length: n_token -> {(doc index, EDU index)}
+  map<unsigned, vector<pair<unsigned, unsigned>>> groups;
+  vector<vector<Expression>> sent_reps(docs.size());
+  // with the cache, an EDU is either cached, or computed once
+  // for the batch and copied to its repeats
+  bool b_cache = ((edu_cache != nullptr) and (!b_dropout));
+  map<Edu, pair<unsigned, unsigned>> firsts;
+  vector<pair<pair<unsigned, unsigned>, pair<unsigned, unsigned>>> repeats;
+  vector<float> value;
+  cache_pending.clear();
+  for (unsigned k = 0; k < docs.size(); k++){
+    const Doc& doc = *docs[k];
+    sent_reps[k].resize(doc.n_edus());
+    for (unsigned idx = 0; idx < doc.n_edus(); idx++){
+      EduView edu = doc.edu(idx);
+      if (b_cache){
+	Edu key(edu.begin(), edu.end());
+	auto it = firsts.find(key);
+	if (it != firsts.end()){
+	  repeats.push_back(make_pair(make_pair(k, idx), it->second));
+	  continue;
+	}
+	if (edu_cache->get(edu, value)){
+	  sent_reps[k][idx] = input(cg, {rep_dim}, value);
+	  continue;
+	}
+	firsts[key] = make_pair(k, idx);
+      }
+      groups[edu.size()].push_back(make_pair(k, idx));
+    }
+  }
+  for (auto& group : groups){
+    unsigned n_token = group.first;
+    auto& members = group.second;
+    // for each group of sentences
     fw_senbuilder.start_new_sequence();
     bw_senbuilder.start_new_sequence();
-    // 
-    Edu edu = edus[idx];
-    unsigned n_token = edu.size();
-    // cerr << "n_token = " << n_token << endl;
-    for (int t = 0; t < n_token; t++){
-      Expression w_t, h_t;
-      if (b_pretrained){
-	// cerr << "get from pretrained embeddings " << endl;
-	vector<float> v = embeddings[edu[t]];
-	// constant input, no update
-	w_t = input(cg, {(unsigned)v.size()}, v);
-      } else {
-	w_t = lookup(cg, p_W, edu[t]);
-      }
+    vector<unsigned> words(members.size());
+    for (unsigned t = 0; t < n_token; t++){
+      for (unsigned m = 0; m < members.size(); m++)
+	words[m] = docs[members[m].first]->edu(members[m].second)[t];
+      Expression w_t = embed_words(words, cg);
       // input dropout
       if (b_dropout) w_t = dropout(w_t, dropout_rate);
-      h_t = fw_senbuilder.add_input(w_t);
+      fw_senbuilder.add_input(w_t);
     }
     for (int t = n_token - 1; t > -1; t--){
-      Expression w_t, h_t;
-      if (b_pretrained){
-	vector<float> v = embeddings[edu[t]];
-	w_t = input(cg, {(unsigned)v.size()}, v);
-      } else {
-	w_t = lookup(cg, p_W, edu[t]);
-      }
+      for (unsigned m = 0; m < members.size(); m++)
+	words[m] = docs[members[m].first]->edu(members[m].second)[t];
+      Expression w_t = embed_words(words, cg);
       // input dropout
       if (b_dropout) w_t = dropout(w_t, dropout_rate);
-      h_t = bw_senbuilder.add_input(w_t);
+      bw_senbuilder.add_input(w_t);
     }
     // take the last hidden state as the sent rep
     Expression senrep = concatenate({fw_senbuilder.back(), bw_senbuilder.back()});
-    sent_reps.push_back(senrep);
+    if (members.size() == 1){
+      sent_reps[members[0].first][members[0].second] = senrep;
+    } else {
+      for (unsigned m = 0; m < members.size(); m++)
+	sent_reps[members[m].first][members[m].second] = pick_batch_elem(senrep, m);
+    }
+  }
+  if (b_cache){
+    for (auto& r : repeats)
+      sent_reps[r.first.first][r.first.second] = sent_reps[r.second.first][r.second.second];
+    for (auto& f : firsts)
+      cache_pending.push_back(make_pair(docs[f.second.first]->edu(f.second.second),
+					sent_reps[f.second.first][f.second.second]));
   }
   return sent_reps;
 }
 
+
+template <class Builder>
+void TextClass<Builder>::cache_edus(){
+  for (auto& p : cache_pending)
+    edu_cache->put(p.first, as_vector(p.second.value()));
+  cache_pending.clear();
+}
+
+template <class Builder>
+InferSource TextClass<Builder>::infer_source(){
+  InferSource src;
+  src.arch = march;
+  if (b_pretrained){
+    src.emb = embed_table;
+    src.vocab_size = embed_size;
+    src.input_dim = embed_dim;
+  } else {
+    LookupParameterStorage* words = p_W.get();
+    src.emb = words->all_values.v;
+    src.vocab_size = words->values.size();
+    src.input_dim = words->dim.rows();
+  }
+  src.Ua = p_Ua.get();
+  src.Ut = p_Ut.get();
+  src.Uc = p_Uc.get();
+  src.bias = p_bias.get();
+  for (auto& layer : fw_senbuilder.params){
+    src.fw.push_back(vector<ParameterStorage*>());
+    for (auto& p : layer) src.fw.back().push_back(p.get());
+  }
+  for (auto& layer : bw_senbuilder.params){
+    src.bw.push_back(vector<ParameterStorage*>());
+    for (auto& p : layer) src.bw.back().push_back(p.get());
+  }
+  return src;
+}
+
+/*******************************************************
+ * pretrained embeddings stay in the table given to the
+ * constructor, outside of any model, so the trainer never
+ * sees them. Their rows for a batch of words are copied
+ * into one constant input
+ *******************************************************/
+template <class Builder>
+Expression TextClass<Builder>::embed_words(const vector<unsigned>& words,
+					   ComputationGraph& cg){
+  if (b_pretrained){
+    // constant input, no update
+    vector<float> values(words.size() * embed_dim);
+    for (unsigned k = 0; k < words.size(); k++){
+      const float* row = embed_table + (size_t)words[k] * embed_dim;
+      copy(row, row + embed_dim, values.begin() + (size_t)k * embed_dim);
+    }
+    return input(cg, Dim({embed_dim}, words.size()), values);
+  } else {
+    return lookup(cg, p_W, words);
+  }
+}
+
 #endif
@@ -4,67 +4,432 @@
 // Time-stamp: <yangfeng 12/28/2016 18:52:16>
 
 #include <algorithm>
-#include <queue>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <thread>
+#include <memory>
+#include <sstream>
+#include <cctype>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.h"
 
+#include <unordered_map>
+
 using namespace std;
 
 #include <boost/algorithm/string.hpp>
 
+// record the pnode and the relation of an EDU
+static void add_link(DocDraft& doc, int eidx, int pidx, int ridx){
+  if (eidx < 0){
+    cerr << "Wrong EDU index " << eidx << endl;
+    exit(1);
+  }
+  if ((unsigned)eidx >= doc.parents.size()){
+    doc.parents.resize(eidx + 1, -1);
+    doc.relas.resize(eidx + 1, 0);
+  }
+  doc.parents[eidx] = pidx; // store the pnode index
+  doc.relas[eidx] = ridx; // relation index
+  if (pidx == -1) doc.root = eidx; // root node
+}
+
+// an int field, without the exceptions of stoi
+static bool read_int(const string& field, long lo, long hi, int& val){
+  if (field.empty()) return false;
+  char* end = nullptr;
+  errno = 0;
+  long v = strtol(field.c_str(), &end, 10);
+  if ((*end != '\0') or (errno != 0) or (v < lo) or (v > hi)) return false;
+  val = v;
+  return true;
+}
+
+// the fields of an EDU line, whose EDU is already added to
+// doc. The EDUs come in index order, so an index past the
+// EDUs read so far is wrong. False if a field is not a
+// number or is out of range; nrela > 0 bounds the relation
+static bool read_link(DocDraft& doc, const string& efield,
+		      const string& pfield, const string& rfield,
+		      unsigned nrela){
+  int eidx, pidx, ridx;
+  if ((!read_int(efield, 0, INT_MAX, eidx)) or (!read_int(pfield, -1, INT_MAX, pidx))
+      or (!read_int(rfield, 0, (nrela > 0 ? nrela - 1 : INT_MAX), ridx))
+      or ((unsigned)eidx >= doc.n_edus()))
+    return false;
+  add_link(doc, eidx, pidx, ridx);
+  return true;
+}
+
+// the label field of an end of doc line
+static bool read_label(const string& field, unsigned& label){
+  int val = 0;
+  if (!read_int(field, 0, INT_MAX, val)) return false;
+  label = val;
+  return true;
+}
+
+// the checks of add_doc, and a root without a pnode, so a
+// bad doc can be skipped before it is built; the reason
+// goes to msg
+static bool check_tree(const DocDraft& doc, string& msg){
+  unsigned n_edus = doc.n_edus();
+  if ((doc.parents.size() != n_edus) or (doc.root < 0)
+      or (doc.parents[doc.root] != -1)){
+    msg = "Wrong tree structure: " + doc.filename;
+    return false;
+  }
+  for (auto pidx : doc.parents){
+    if (pidx >= (int)n_edus){
+      msg = "Wrong pnode index " + to_string(pidx) + " in " + doc.filename;
+      return false;
+    }
+  }
+  return true;
+}
+
+void DocParser::fail(const string& msg){
+  if (!b_lenient){
+    cerr << msg << endl;
+    exit(1);
+  }
+  if (cur_err.empty()) cur_err = msg; // the first error of the doc
+}
+
+bool DocParser::check_tree(){
+  string msg;
+  if (::check_tree(cur, msg)) return true;
+  fail(msg);
+  return false;
+}
+
+bool DocParser::add_line(const string& line, Corpus& corpus){
+  if (line.empty()) return false; // just in case
+  vector<string> items;
+  boost::split(items, line, boost::is_any_of("\t"));
+  if (line[0] != '='){
+    // within document; the rest of a bad doc is skipped
+    if (!cur_err.empty()) return false;
+    if (items.size() < 4){
+      fail("Wrong EDU line: " + line);
+      return false;
+    }
+    cur.add_edu(read_edu(items[3], dptr, b_update)); // store the edu
+    if (!read_link(cur, items[0], items[1], items[2], nrela))
+      fail("Wrong EDU line: " + line);
+    return false;
+  }
+  // end of document
+  if ((items.size() < 3) or (!read_label(items[2], cur.label)))
+    fail("Wrong end of doc line: " + line);
+  if (items.size() > 1) cur.filename = items[1]; // get filename
+  err.clear();
+  bool b_doc = (cur.n_edus() > 0) and cur_err.empty() and check_tree();
+  if (b_doc){
+    // build the tree and the topological order
+    corpus.add_doc(cur);
+  } else if (cur_err.empty() and (cur.n_edus() == 0)){
+    cerr << "Empty doc: " << cur.filename << endl;
+    if (b_lenient) cur_err = "Empty doc: " + cur.filename;
+  }
+  err = cur_err;
+  cur.clear(); // reset this variable
+  cur_err.clear();
+  // a lenient parser reports every ended doc, good or not
+  return b_doc or (b_lenient and !err.empty());
+}
+
+bool DocParser::flush(Corpus& corpus){
+  err.clear();
+  if ((cur.n_edus() == 0) and cur_err.empty()) return false;
+  bool b_doc = cur_err.empty() and check_tree();
+  if (b_doc) corpus.add_doc(cur);
+  err = cur_err;
+  cur.clear();
+  cur_err.clear();
+  return b_doc or (b_lenient and !err.empty());
+}
+
+CorpusReader::CorpusReader(const string& fname, dynet::Dict* dptr):
+  parser(dptr, false){
+  if (is_compiled_corpus(fname)){
+    compiled.reset(new MappedCorpus(fname, dptr));
+    return;
+  }
+  cerr << "Streaming data from " << fname << endl;
+  in.open(fname);
+  if (!in.good()){
+    cerr << "Cannot open " << fname << endl;
+    exit(1);
+  }
+  string line;
+  getline(in, line); // get rid of the title line
+}
+
+bool CorpusReader::next(Corpus& corpus){
+  if (compiled){
+    if (pos >= compiled->size()) return false;
+    compiled->copy_doc(pos++, corpus);
+    return true;
+  }
+  string line;
+  while ((!b_done) and getline(in, line)){
+    if (parser.add_line(line, corpus)) return true;
+  }
+  if (b_done) return false;
+  b_done = true;
+  return parser.flush(corpus);
+}
+
+size_t count_docs(const string& fname){
+  if (is_compiled_corpus(fname)){
+    MappedCorpus mapped(fname, nullptr);
+    return mapped.size();
+  }
+  ifstream in(fname);
+  if (!in.good()){
+    cerr << "Cannot open " << fname << endl;
+    exit(1);
+  }
+  // each doc ends with a '=' line, except maybe the last one
+  string line;
+  getline(in, line); // title line
+  size_t n = 0;
+  bool b_open = false;
+  while (getline(in, line)){
+    if (line.empty()) continue;
+    if (line[0] == '='){
+      n ++;
+      b_open = false;
+    } else {
+      b_open = true;
+    }
+  }
+  return b_open ? n + 1 : n;
+}
+
 Corpus read_corpus(char* filename, dynet::Dict* dptr,
-		   bool b_update){
+		   bool b_update, unsigned nthreads){
+  if (is_compiled_corpus(filename)){
+    // tokenized already, no dict update
+    return load_compiled_corpus(filename, dptr);
+  }
+  if (nthreads == 0) nthreads = thread::hardware_concurrency();
+  if (nthreads > 1){
+    return read_corpus_parallel(filename, dptr, b_update, nthreads);
+  }
   cerr << "Reading data from " << filename << endl;
   Corpus corpus;
-  Doc doc;
-  Edu edu;
+  DocParser parser(dptr, b_update);
   string line;
   ifstream in(filename);
   getline(in, line); // get rid of the title line
   // cerr << line << endl;
-  while (getline(in, line)){
-    if (line.empty()) continue; // just in case
-    if (line[0] != '='){
+  while (getline(in, line)) parser.add_line(line, corpus);
+  parser.flush(corpus);
+  cerr << "Read " << corpus.size() << " docs with the vocab has " << dptr->size() << " types" << endl;
+  return(corpus);
+}
+
+
+// *******************************************************
+// parallel reader
+//
+// The file is cut into chunks at document boundaries
+// ('=' lines). Each thread tokenizes its chunks with a
+// local vocab, in the order of first occurrence. The
+// local vocabs are then merged into the dict chunk by
+// chunk, which gives the same word ids as the serial
+// reader
+// *******************************************************
+struct CorpusChunk{
+  const char* begin;
+  const char* end;
+  Corpus docs; // token ids are local until remapped
+  vector<string> types; // local vocab, first occurrence order
+  vector<string> empty_docs;
+};
+
+// split a tab-separated field, ends at tab or end of line
+static const char* next_field(const char* p, const char* eol){
+  while ((p < eol) and (*p != '\t')) p++;
+  return p;
+}
+
+static void parse_chunk(CorpusChunk& chunk){
+  unordered_map<string, int> local;
+  auto local_id = [&](const string& tok) -> int {
+    auto it = local.find(tok);
+    if (it != local.end()) return it->second;
+    int id = chunk.types.size();
+    local[tok] = id;
+    chunk.types.push_back(tok);
+    return id;
+  };
+  DocDraft doc;
+  const char* p = chunk.begin;
+  while (p < chunk.end){
+    const char* eol = (const char*)memchr(p, '\n', chunk.end - p);
+    if (eol == nullptr) eol = chunk.end;
+    if (eol == p){ p = eol + 1; continue; } // just in case
+    // fields of this line
+    const char* fend[4];
+    const char* f = p;
+    unsigned nfield = 0;
+    while (nfield < 4){
+      fend[nfield] = next_field(f, eol);
+      nfield ++;
+      if (fend[nfield-1] == eol) break;
+      f = fend[nfield-1] + 1;
+    }
+    if (*p != '='){
       // within document
-      vector<string> items;
-      boost::split(items, line, boost::is_any_of("\t"));
-      int eidx = std::stoi(items[0]);
-      int pidx = std::stoi(items[1]);
-      int ridx = std::stoi(items[2]);
-      edu = read_edu(items[3], dptr, b_update);
-      doc.edus.push_back(edu); // store the edu
-      doc.tree[pidx].push_back(eidx); // store the pnode index
-      doc.relas[eidx] = ridx; // relation index
-      if (pidx == -1) doc.root = eidx; // root node
+      if (nfield < 4){
+	cerr << "Wrong line format: " << string(p, eol) << endl;
+	exit(1);
+      }
+      size_t ntok = doc.tokens.size();
+      const char* t = fend[2] + 1;
+      while (t < fend[3]){
+	const char* tend = t;
+	while ((tend < fend[3]) and (*tend != ' ')) tend++;
+	if (tend > t) doc.tokens.push_back(local_id(string(t, tend)));
+	t = tend + 1;
+      }
+      if (doc.tokens.size() == ntok) doc.tokens.push_back(local_id("UNK"));
+      doc.edu_ends.push_back(doc.tokens.size());
+      if (!read_link(doc, string(p, fend[0]), string(fend[0] + 1, fend[1]),
+		     string(fend[1] + 1, fend[2]), 0)){
+	cerr << "Wrong EDU line: " << string(p, eol) << endl;
+	exit(1);
+      }
     } else {
       // end of document
-      vector<string> items;
-      boost::split(items, line, boost::is_any_of("\t"));
-      doc.filename = items[1]; // get filename
-      doc.label = std::stoul(items[2]); // get label
-      if (doc.edus.size() > 0){
-	// before save this doc, get the topological order
-	doc.order = topological_sorting(doc);
-	// cerr << "filename = " << doc.filename << endl;
-	// print_int_vector(doc.order);
-	// save this doc
-	corpus.push_back(doc);
+      if ((nfield < 3) or (!read_label(string(fend[1] + 1, fend[2]), doc.label))){
+	cerr << "Wrong end of doc line: " << string(p, eol) << endl;
+	exit(1);
+      }
+      doc.filename.assign(fend[0] + 1, fend[1]);
+      string msg;
+      if ((doc.n_edus() > 0) and (!check_tree(doc, msg))){
+	cerr << msg << endl;
+	exit(1);
+      }
+      if (doc.n_edus() > 0){
+	chunk.docs.add_doc(doc);
       } else {
-	cerr << "Empty doc: " << doc.filename << endl;
+	chunk.empty_docs.push_back(doc.filename);
       }
-      doc = Doc(); // reset this variable
+      doc.clear();
     }
+    p = eol + 1;
   }
-  if (doc.edus.size() > 0){
-    doc.order = topological_sorting(doc);
-    cerr << "filename = " << doc.filename << endl;
-    print_int_vector(doc.order);
-    corpus.push_back(doc);
+  if (doc.n_edus() > 0){
+    string msg;
+    if (!check_tree(doc, msg)){
+      cerr << msg << endl;
+      exit(1);
+    }
+    chunk.docs.add_doc(doc);
   }
-  cerr << "Read " << corpus.size() << " docs with the vocab has " << dptr->size() << " types" << endl;
-  return(corpus);
 }
 
+Corpus read_corpus_parallel(char* filename, dynet::Dict* dptr,
+			    bool b_update, unsigned nthreads){
+  cerr << "Reading data from " << filename << " with "
+       << nthreads << " threads" << endl;
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if ((fd < 0) or (fstat(fd, &st) != 0)){
+    cerr << "Cannot open " << filename << endl;
+    exit(1);
+  }
+  size_t fsize = st.st_size;
+  Corpus corpus;
+  if (fsize == 0){
+    close(fd);
+    return corpus;
+  }
+  void* addr = mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED){
+    cerr << "Cannot map " << filename << endl;
+    exit(1);
+  }
+  const char* base = (const char*)addr;
+  const char* end = base + fsize;
+  // get rid of the title line
+  const char* p = (const char*)memchr(base, '\n', fsize);
+  p = (p == nullptr) ? end : p + 1;
+  // cut into chunks right after an end-of-document line
+  unsigned nchunk = nthreads * 4;
+  size_t step = (end - p) / nchunk + 1;
+  vector<CorpusChunk> chunks;
+  while (p < end){
+    const char* q = p + min(step, (size_t)(end - p));
+    while (q < end){
+      // move q to the beginning of a line
+      if (*(q-1) != '\n'){
+	q = (const char*)memchr(q, '\n', end - q);
+	q = (q == nullptr) ? end : q + 1;
+	continue;
+      }
+      if (*q == '='){
+	q = (const char*)memchr(q, '\n', end - q);
+	q = (q == nullptr) ? end : q + 1;
+	break;
+      }
+      q = (const char*)memchr(q, '\n', end - q);
+      q = (q == nullptr) ? end : q + 1;
+    }
+    CorpusChunk chunk;
+    chunk.begin = p; chunk.end = q;
+    chunks.push_back(std::move(chunk));
+    p = q;
+  }
+  // tokenize
+  auto run = [&](unsigned tid){
+    for (unsigned k = tid; k < chunks.size(); k += nthreads)
+      parse_chunk(chunks[k]);
+  };
+  vector<thread> workers;
+  for (unsigned tid = 0; tid < nthreads; tid++) workers.push_back(thread(run, tid));
+  for (auto& w : workers) w.join();
+  munmap(addr, fsize);
+  // merge local vocabs in chunk order
+  vector<vector<int>> idmaps(chunks.size());
+  for (unsigned k = 0; k < chunks.size(); k++){
+    for (auto& tok : chunks[k].types){
+      if (b_update or dptr->contains(tok)){
+	idmaps[k].push_back(dptr->convert(tok));
+      } else {
+	idmaps[k].push_back(dptr->convert("UNK"));
+      }
+    }
+  }
+  // remap token ids
+  auto remap = [&](unsigned tid){
+    for (unsigned k = tid; k < chunks.size(); k += nthreads)
+      chunks[k].docs.remap_tokens(idmaps[k]);
+  };
+  workers.clear();
+  for (unsigned tid = 0; tid < nthreads; tid++) workers.push_back(thread(remap, tid));
+  for (auto& w : workers) w.join();
+  for (auto& chunk : chunks){
+    for (auto& fname : chunk.empty_docs) cerr << "Empty doc: " << fname << endl;
+    corpus.append(chunk.docs);
+    chunk.docs = Corpus(); // free the chunk as soon as it is copied
+  }
+  cerr << "Read " << corpus.size() << " docs with the vocab has " << dptr->size() << " types" << endl;
+  return corpus;
+}
 
 Edu read_edu(const string& line, dynet::Dict* dptr, bool b_update){
   vector<string> tokens;
@@ -88,27 +453,223 @@ Edu read_edu(const string& line, dynet::Dict* dptr, bool b_update){
 }
 
 
-vector<int> topological_sorting(Doc& doc){
+// *******************************************************
+// corpus storage
+//
+// add_doc builds the CSR tree of a parsed doc from the
+// pnode of each EDU, then its topological order and its
+// levels, all written to the end of the store
+// *******************************************************
+void Corpus::clear(){
+  docs.clear();
+  if (store.use_count() > 1){
+    // other copies still read it
+    store = make_shared<CorpusStore>();
+    return;
+  }
+  CorpusStore& s = *store;
+  s.tokens.clear(); s.relas.clear(); s.order.clear(); s.level_nodes.clear();
+  s.child_offsets.clear(); s.child_nodes.clear(); s.level_offsets.clear();
+  s.chars.clear();
+  s.edu_toks.assign(1, 0);
+}
+
+void Corpus::add_doc(const DocDraft& draft){
+  unsigned n_edus = draft.n_edus();
+  if ((draft.parents.size() != n_edus) or (draft.root < 0)){
+    cerr << "Wrong tree structure: " << draft.filename << endl;
+    exit(1);
+  }
+  CorpusStore& s = *store;
+  Doc doc;
+  doc.store = store.get();
+  doc.n_edu = n_edus;
+  doc.root = draft.root;
+  doc.label = draft.label;
+  // tokens and relations
+  doc.edu_first = s.edu_toks.size() - 1;
+  uint64_t tok_base = s.tokens.size();
+  s.tokens.insert(s.tokens.end(), draft.tokens.begin(), draft.tokens.end());
+  for (auto end : draft.edu_ends) s.edu_toks.push_back(tok_base + end);
+  s.relas.insert(s.relas.end(), draft.relas.begin(), draft.relas.end());
+  // count children, then place them in input order
+  doc.child_first = s.child_offsets.size();
+  s.child_offsets.resize(doc.child_first + n_edus + 1, 0);
+  unsigned* offsets = s.child_offsets.data() + doc.child_first;
+  for (auto pidx : draft.parents){
+    if (pidx < 0) continue;
+    if ((unsigned)pidx >= n_edus){
+      cerr << "Wrong pnode index " << pidx << " in " << draft.filename << endl;
+      exit(1);
+    }
+    offsets[pidx+1] ++;
+  }
+  for (unsigned i = 0; i < n_edus; i++) offsets[i+1] += offsets[i];
+  doc.node_first = s.child_nodes.size();
+  s.child_nodes.resize(doc.node_first + offsets[n_edus]);
+  vector<unsigned> pos(offsets, offsets + n_edus);
+  for (unsigned eidx = 0; eidx < n_edus; eidx++){
+    int pidx = draft.parents[eidx];
+    if (pidx >= 0) s.child_nodes[doc.node_first + pos[pidx]++] = eidx;
+  }
+  // topological order
+  vector<int> order = topological_sorting(doc);
+  doc.order_first = s.order.size();
+  doc.n_order = order.size();
+  s.order.insert(s.order.end(), order.begin(), order.end());
+  // group the pnodes in the topological order by their
+  // height in the tree: all children of a pnode are in
+  // lower levels, so each level only depends on the ones
+  // before it
+  vector<unsigned> height(n_edus, 0);
+  unsigned n_levels = 0;
+  for (auto pidx : order){
+    for (auto cidx : doc.children(pidx))
+      height[pidx] = max(height[pidx], height[cidx] + 1);
+    n_levels = max(n_levels, height[pidx] + 1);
+  }
+  doc.n_level = n_levels;
+  doc.level_first = s.level_offsets.size();
+  s.level_offsets.resize(doc.level_first + n_levels + 1, 0);
+  unsigned* level_offsets = s.level_offsets.data() + doc.level_first;
+  for (auto pidx : order) level_offsets[height[pidx]+1] ++;
+  for (unsigned h = 0; h < n_levels; h++) level_offsets[h+1] += level_offsets[h];
+  s.level_nodes.resize(doc.order_first + order.size());
+  pos.assign(level_offsets, level_offsets + n_levels);
+  for (auto pidx : order) s.level_nodes[doc.order_first + pos[height[pidx]]++] = pidx;
+  // filename
+  doc.name_first = s.chars.size();
+  doc.name_len = draft.filename.size();
+  s.chars.insert(s.chars.end(), draft.filename.begin(), draft.filename.end());
+  docs.push_back(doc);
+}
+
+template <class T>
+static void copy_slice(vector<T>& to, const T* from, uint64_t first, uint64_t n){
+  to.insert(to.end(), from + first, from + first + n);
+}
+
+void Corpus::add_doc(const Doc& other){
+  if (other.store == store.get()){
+    // already in the store
+    docs.push_back(other);
+    return;
+  }
+  const CorpusStore& o = *other.store;
+  StoreArrays from = {o.tokens.data(), o.edu_toks.data(), o.relas.data(),
+		      o.order.data(), o.level_nodes.data(), o.child_offsets.data(),
+		      o.child_nodes.data(), o.level_offsets.data(), o.chars.data()};
+  add_doc(other, from);
+}
+
+void Corpus::add_doc(const DocEntry& other, const StoreArrays& o){
+  CorpusStore& s = *store;
+  Doc doc;
+  static_cast<DocEntry&>(doc) = other;
+  doc.store = store.get();
+  // copy each slice of the other store; offsets within a
+  // doc stay the same
+  doc.edu_first = s.edu_toks.size() - 1;
+  uint64_t tok_first = o.edu_toks[other.edu_first];
+  uint64_t tok_base = s.tokens.size();
+  copy_slice(s.tokens, o.tokens, tok_first, o.edu_toks[other.edu_first + other.n_edu] - tok_first);
+  for (unsigned eidx = 1; eidx <= other.n_edu; eidx++)
+    s.edu_toks.push_back(tok_base + o.edu_toks[other.edu_first + eidx] - tok_first);
+  copy_slice(s.relas, o.relas, other.edu_first, other.n_edu);
+  doc.order_first = s.order.size();
+  copy_slice(s.order, o.order, other.order_first, other.n_order);
+  copy_slice(s.level_nodes, o.level_nodes, other.order_first, other.n_order);
+  doc.child_first = s.child_offsets.size();
+  copy_slice(s.child_offsets, o.child_offsets, other.child_first, other.n_edu + 1);
+  doc.node_first = s.child_nodes.size();
+  copy_slice(s.child_nodes, o.child_nodes, other.node_first,
+	     o.child_offsets[other.child_first + other.n_edu]);
+  doc.level_first = s.level_offsets.size();
+  copy_slice(s.level_offsets, o.level_offsets, other.level_first, other.n_level + 1);
+  doc.name_first = s.chars.size();
+  copy_slice(s.chars, o.chars, other.name_first, other.name_len);
+  docs.push_back(doc);
+}
+
+void Corpus::append(const Corpus& other){
+  const CorpusStore& o = *other.store;
+  CorpusStore& s = *store;
+  s.tokens.reserve(s.tokens.size() + o.tokens.size());
+  s.edu_toks.reserve(s.edu_toks.size() + o.edu_toks.size());
+  s.relas.reserve(s.relas.size() + o.relas.size());
+  s.order.reserve(s.order.size() + o.order.size());
+  s.level_nodes.reserve(s.level_nodes.size() + o.level_nodes.size());
+  s.child_offsets.reserve(s.child_offsets.size() + o.child_offsets.size());
+  s.child_nodes.reserve(s.child_nodes.size() + o.child_nodes.size());
+  s.level_offsets.reserve(s.level_offsets.size() + o.level_offsets.size());
+  s.chars.reserve(s.chars.size() + o.chars.size());
+  docs.reserve(docs.size() + other.size());
+  for (auto& doc : other) add_doc(doc);
+}
+
+void Corpus::remap_tokens(const vector<int>& idmap){
+  for (auto& w : store->tokens) w = idmap[w];
+}
+
+size_t Corpus::n_bytes() const{
+  const CorpusStore& s = *store;
+  return docs.capacity() * sizeof(Doc) + s.tokens.capacity() * sizeof(int)
+    + s.edu_toks.capacity() * sizeof(uint64_t) + s.relas.capacity() * sizeof(int)
+    + s.order.capacity() * sizeof(int) + s.level_nodes.capacity() * sizeof(int)
+    + s.child_offsets.capacity() * sizeof(unsigned)
+    + s.child_nodes.capacity() * sizeof(int)
+    + s.level_offsets.capacity() * sizeof(unsigned) + s.chars.capacity();
+}
+
+
+vector<int> topological_sorting(const Doc& doc){
   vector<int> pnode_list;
-  queue<int> q;
-  q.push(doc.tree[-1][0]); // add the root node
-  // cerr << q.front() << " " << doc.tree[-1][0] << endl;
-  // exit(1);
-  while(!q.empty()){
-    int pidx = q.front();
-    // cerr << "pidx = " << pidx << endl;
-    q.pop();
-    pnode_list.push_back(pidx);
-    for (auto& v : doc.tree[pidx]){
-      q.push(v);
-    }
-  }
-  // pnode_list.reverse();
+  pnode_list.reserve(doc.n_edus());
+  // breadth-first from the root node, the list itself
+  // serves as the queue
+  pnode_list.push_back(doc.root);
+  for (unsigned head = 0; head < pnode_list.size(); head++){
+    for (auto cidx : doc.children(pnode_list[head])){
+      pnode_list.push_back(cidx);
+    }
+  }
   reverse(pnode_list.begin(), pnode_list.end());
   return pnode_list;
 }
 
 
+// *******************************************************
+// shuffle the corpus and cut it into batches of doc
+// indices. With b_bucket, docs are sorted by the number
+// of EDUs (ties in random order) before cutting, and the
+// batches are shuffled afterwards
+// *******************************************************
+vector<vector<unsigned>> make_batches(const Corpus& corpus, unsigned batchsize,
+				      bool b_bucket, std::mt19937& rng){
+  vector<unsigned> order(corpus.size());
+  for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+  return make_batches(corpus, order, batchsize, b_bucket, rng);
+}
+
+
+vector<vector<unsigned>> make_batches(const Corpus& corpus, const vector<unsigned>& subset,
+				      unsigned batchsize, bool b_bucket, std::mt19937& rng){
+  vector<unsigned> order(subset);
+  shuffle(order.begin(), order.end(), rng);
+  if (b_bucket){
+    stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b){
+	return corpus[a].n_edus() < corpus[b].n_edus();});
+  }
+  vector<vector<unsigned>> batches;
+  for (unsigned i = 0; i < order.size(); i += batchsize){
+    unsigned j = min(i + batchsize, (unsigned)order.size());
+    batches.push_back(vector<unsigned>(order.begin() + i, order.begin() + j));
+  }
+  if (b_bucket) shuffle(batches.begin(), batches.end(), rng);
+  return batches;
+}
+
+
 void print_int_vector(const vector<int>& vec){
   for (auto& val : vec){
     cerr << val << " ";
@@ -147,22 +708,648 @@ int load_dict(string fname, dynet::Dict& d){
 }
 
 // *******************************************************
-// load model from a archive file
+// compiled corpus
+//
+// layout: header, then the doc records and the arrays of
+// the corpus store as they are in memory, each section
+// starting at an 8-byte boundary
+//   docs          [ndocs]   DocEntry
+//   tokens        [ntokens] int32
+//   edu_toks      [nedus+1] uint64
+//   relas         [nedus]   int32
+//   order         [norder]  int32
+//   level_nodes   [norder]  int32
+//   child_offsets [nchild]  uint32
+//   child_nodes   [nnodes]  int32
+//   level_offsets [nlevel]  uint32
+//   chars         [nchars]  char
 // *******************************************************
-int load_model(string fname, Model& model){
-  ifstream in(fname);
-  boost::archive::text_iarchive ia(in);
-  ia >> model;
+struct CorpusHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t vocab_size;
+  uint64_t dict_hash; // fingerprint of the dict used for the ids
+  uint64_t ndocs;
+  uint64_t nedus;
+  uint64_t ntokens;
+  uint64_t norder;
+  uint64_t nchild;
+  uint64_t nnodes;
+  uint64_t nlevel;
+  uint64_t nchars;
+};
+
+template <class T>
+static void write_section(ofstream& out, const vector<T>& vec){
+  size_t nbytes = vec.size() * sizeof(T);
+  if (nbytes > 0) out.write((const char*)vec.data(), nbytes);
+  static const char pad[8] = {0};
+  if (nbytes % 8 != 0) out.write(pad, 8 - nbytes % 8);
+}
+
+// read a section from a mapped file, return nullptr if it
+// runs over the end of the file
+template <class T>
+static const T* read_section(const char* base, size_t fsize,
+			     size_t& pos, uint64_t n){
+  if ((pos > fsize) or (n > (fsize - pos) / sizeof(T))) return nullptr;
+  const T* ptr = (const T*)(base + pos);
+  size_t nbytes = n * sizeof(T);
+  pos += (nbytes + 7) / 8 * 8;
+  return ptr;
+}
+
+uint64_t dict_fingerprint(dynet::Dict& d){
+  // FNV-1a over all word types in id order
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned i = 0; i < d.size(); i++){
+    const string& w = d.convert((int)i);
+    for (auto c : w){
+      h ^= (unsigned char)c; h *= 1099511628211ULL;
+    }
+    h ^= (unsigned char)'\n'; h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+bool is_compiled_corpus(const string& fname){
+  ifstream in(fname, ios::binary);
+  char magic[8] = {0};
+  in.read(magic, 8);
+  return (in.gcount() == 8) and (memcmp(magic, CORPUS_MAGIC, 8) == 0);
+}
+
+int save_compiled_corpus(string fname, const Corpus& corpus, dynet::Dict& d){
+  const CorpusStore& s = *corpus.store;
+  vector<DocEntry> entries(corpus.begin(), corpus.end());
+  CorpusHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CORPUS_MAGIC, 8);
+  header.version = CORPUS_VERSION;
+  header.vocab_size = d.size();
+  header.dict_hash = dict_fingerprint(d);
+  header.ndocs = entries.size();
+  header.nedus = s.relas.size();
+  header.ntokens = s.tokens.size();
+  header.norder = s.order.size();
+  header.nchild = s.child_offsets.size();
+  header.nnodes = s.child_nodes.size();
+  header.nlevel = s.level_offsets.size();
+  header.nchars = s.chars.size();
+  ofstream out(fname, ios::binary);
+  if (!out.good()){
+    cerr << "Cannot write compiled corpus to " << fname << endl;
+    return 1;
+  }
+  out.write((const char*)&header, sizeof(header));
+  write_section(out, entries);
+  write_section(out, s.tokens);
+  write_section(out, s.edu_toks);
+  write_section(out, s.relas);
+  write_section(out, s.order);
+  write_section(out, s.level_nodes);
+  write_section(out, s.child_offsets);
+  write_section(out, s.child_nodes);
+  write_section(out, s.level_offsets);
+  write_section(out, s.chars);
+  out.close();
+  cerr << "Write " << corpus.size() << " docs (" << s.tokens.size()
+       << " tokens) to " << fname << endl;
   return 0;
 }
 
+// map a compiled corpus and check its header; the dict is
+// not checked without dptr
+static const char* map_compiled_corpus(const string& fname, dynet::Dict* dptr,
+				       size_t& fsize, CorpusHeader& header){
+  int fd = open(fname.c_str(), O_RDONLY);
+  struct stat st;
+  if ((fd < 0) or (fstat(fd, &st) != 0)){
+    cerr << "Cannot open " << fname << endl;
+    exit(1);
+  }
+  fsize = st.st_size;
+  void* addr = mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED){
+    cerr << "Cannot map " << fname << endl;
+    exit(1);
+  }
+  const char* base = (const char*)addr;
+  if (fsize < sizeof(header)){
+    cerr << "Truncated compiled corpus: " << fname << endl;
+    exit(1);
+  }
+  memcpy(&header, base, sizeof(header));
+  if (header.version != CORPUS_VERSION){
+    cerr << "Compiled corpus " << fname << " has version " << header.version
+	 << ", expected " << CORPUS_VERSION << "; please recompile it" << endl;
+    exit(1);
+  }
+  if ((dptr != nullptr) and ((header.vocab_size != dptr->size())
+			     or (header.dict_hash != dict_fingerprint(*dptr)))){
+    cerr << "Compiled corpus " << fname
+	 << " was built with a different dict" << endl;
+    exit(1);
+  }
+  return base;
+}
+
+// the doc table and the arrays of a mapped compiled corpus,
+// with each slice of each doc checked against its array
+// true if every index of a doc, whose slices are within
+// their arrays, stays within the doc: the child and level
+// offsets go up, and the nodes are EDUs of the doc
+static bool check_doc(const DocEntry& e, const StoreArrays& a){
+  if ((e.n_order > e.n_edu) or ((e.n_edu > 0) and ((e.root < 0) or ((uint32_t)e.root >= e.n_edu))))
+    return false;
+  const unsigned* child_offsets = a.child_offsets + e.child_first;
+  if (child_offsets[0] != 0) return false;
+  for (unsigned i = 0; i < e.n_edu; i++)
+    if (child_offsets[i] > child_offsets[i+1]) return false;
+  for (unsigned i = 0; i < child_offsets[e.n_edu]; i++){
+    int c = a.child_nodes[e.node_first + i];
+    if ((c < 0) or ((unsigned)c >= e.n_edu)) return false;
+  }
+  for (unsigned i = 0; i < e.n_order; i++){
+    int o = a.order[e.order_first + i], l = a.level_nodes[e.order_first + i];
+    if ((o < 0) or ((unsigned)o >= e.n_edu) or (l < 0) or ((unsigned)l >= e.n_edu))
+      return false;
+  }
+  const unsigned* level_offsets = a.level_offsets + e.level_first;
+  if (level_offsets[0] != 0) return false;
+  for (unsigned h = 0; h < e.n_level; h++)
+    if (level_offsets[h] > level_offsets[h+1]) return false;
+  return level_offsets[e.n_level] <= e.n_order;
+}
+
+static void map_sections(const string& fname, const char* base, size_t fsize,
+			 const CorpusHeader& header, const DocEntry*& entries,
+			 StoreArrays& a){
+  size_t pos = sizeof(header);
+  entries = read_section<DocEntry>(base, fsize, pos, header.ndocs);
+  a.tokens = read_section<int>(base, fsize, pos, header.ntokens);
+  a.edu_toks = read_section<uint64_t>(base, fsize, pos, header.nedus + 1);
+  a.relas = read_section<int>(base, fsize, pos, header.nedus);
+  a.order = read_section<int>(base, fsize, pos, header.norder);
+  a.level_nodes = read_section<int>(base, fsize, pos, header.norder);
+  a.child_offsets = read_section<unsigned>(base, fsize, pos, header.nchild);
+  a.child_nodes = read_section<int>(base, fsize, pos, header.nnodes);
+  a.level_offsets = read_section<unsigned>(base, fsize, pos, header.nlevel);
+  a.chars = read_section<char>(base, fsize, pos, header.nchars);
+  if ((entries == nullptr) or (a.tokens == nullptr) or (a.edu_toks == nullptr)
+      or (a.relas == nullptr) or (a.order == nullptr) or (a.level_nodes == nullptr)
+      or (a.child_offsets == nullptr) or (a.child_nodes == nullptr)
+      or (a.level_offsets == nullptr) or (a.chars == nullptr)){
+    cerr << "Truncated compiled corpus: " << fname << endl;
+    exit(1);
+  }
+  for (uint64_t i = 0; i < header.ndocs; i++){
+    const DocEntry& e = entries[i];
+    if ((e.edu_first + e.n_edu > header.nedus)
+	or (e.order_first + e.n_order > header.norder)
+	or (e.child_first + e.n_edu + 1 > header.nchild)
+	or (e.node_first + a.child_offsets[e.child_first + e.n_edu] > header.nnodes)
+	or (e.level_first + e.n_level + 1 > header.nlevel)
+	or (e.name_first + e.name_len > header.nchars)
+	or (!check_doc(e, a))){
+      cerr << "Corrupted compiled corpus: " << fname << endl;
+      exit(1);
+    }
+  }
+  // EDU offsets go up within the tokens, and every token is
+  // a word of the dict
+  bool b_ok = (a.edu_toks[header.nedus] <= header.ntokens);
+  for (uint64_t i = 0; b_ok and (i < header.nedus); i++)
+    b_ok = (a.edu_toks[i] <= a.edu_toks[i+1]);
+  for (uint64_t i = 0; b_ok and (i < header.ntokens); i++)
+    b_ok = (a.tokens[i] >= 0) and ((uint32_t)a.tokens[i] < header.vocab_size);
+  if (!b_ok){
+    cerr << "Corrupted compiled corpus: " << fname << endl;
+    exit(1);
+  }
+}
+
+Corpus load_compiled_corpus(const string& fname, dynet::Dict* dptr){
+  cerr << "Loading compiled data from " << fname << endl;
+  size_t fsize = 0;
+  CorpusHeader header;
+  const char* base = map_compiled_corpus(fname, dptr, fsize, header);
+  const DocEntry* entries;
+  StoreArrays a;
+  map_sections(fname, base, fsize, header, entries, a);
+  // the arrays are copied as a whole, nothing is rebuilt
+  Corpus corpus;
+  CorpusStore& s = *corpus.store;
+  s.tokens.assign(a.tokens, a.tokens + header.ntokens);
+  s.edu_toks.assign(a.edu_toks, a.edu_toks + header.nedus + 1);
+  s.relas.assign(a.relas, a.relas + header.nedus);
+  s.order.assign(a.order, a.order + header.norder);
+  s.level_nodes.assign(a.level_nodes, a.level_nodes + header.norder);
+  s.child_offsets.assign(a.child_offsets, a.child_offsets + header.nchild);
+  s.child_nodes.assign(a.child_nodes, a.child_nodes + header.nnodes);
+  s.level_offsets.assign(a.level_offsets, a.level_offsets + header.nlevel);
+  s.chars.assign(a.chars, a.chars + header.nchars);
+  corpus.docs.resize(header.ndocs);
+  for (uint64_t i = 0; i < header.ndocs; i++){
+    Doc& doc = corpus.docs[i];
+    static_cast<DocEntry&>(doc) = entries[i];
+    doc.store = &s;
+  }
+  munmap((void*)base, fsize);
+  cerr << "Read " << corpus.size() << " docs with the vocab has " << dptr->size() << " types" << endl;
+  return corpus;
+}
+
+MappedCorpus::MappedCorpus(const string& fname, dynet::Dict* dptr){
+  CorpusHeader header;
+  base = map_compiled_corpus(fname, dptr, fsize, header);
+  map_sections(fname, base, fsize, header, entries, arrays);
+  ndocs = header.ndocs;
+}
+
+MappedCorpus::~MappedCorpus(){
+  munmap((void*)base, fsize);
+}
+
 // *******************************************************
-// save model from a archive file
+// pretrained word embeddings
+//
+// layout of the binary file: header, then the table
+//   values [vocab_size * dim] float
 // *******************************************************
-int save_model(string fname, Model& model){
-  ofstream out(fname);
-  boost::archive::text_oarchive oa(out);
-  oa << model; 
+struct EmbedHeader{
+  char magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint32_t vocab_size;
+  uint32_t n_found; // dict words with a vector
+  uint64_t dict_hash; // fingerprint of the dict
+  uint64_t src_size; // size and mtime of the text file
+  int64_t src_mtime;
+  uint64_t n_vectors; // vectors in the text file
+};
+
+// vectors of dict words found in one chunk of the text file
+struct EmbedChunk{
+  const char* begin;
+  const char* end;
+  vector<int> ids;
+  vector<float> values;
+  uint64_t n_vectors = 0;
+  string error;
+};
+
+static void parse_embed_chunk(EmbedChunk& chunk, dynet::Dict& d, unsigned dim,
+			      bool b_first){
+  const char* p = chunk.begin;
+  while (p < chunk.end){
+    const char* eol = (const char*)memchr(p, '\n', chunk.end - p);
+    if (eol == nullptr) eol = chunk.end;
+    const char* sp = p;
+    while ((sp < eol) and (*sp != ' ') and (*sp != '\t')) sp++;
+    string word(p, sp);
+    const char* line = p;
+    p = eol + 1;
+    if (word.empty() or (sp == eol)) continue;
+    if (b_first and (line == chunk.begin)){
+      // the "count dim" header line of the word2vec format
+      char* q = nullptr;
+      strtoul(sp, &q, 10);
+      while ((q < eol) and isspace(*q)) q++;
+      if ((word.find_first_not_of("0123456789") == string::npos) and (q == eol)) continue;
+    }
+    chunk.n_vectors ++;
+    if (!d.contains(word)) continue;
+    size_t offset = chunk.values.size();
+    const char* q = sp;
+    while (q < eol){
+      char* next = nullptr;
+      float v = strtof(q, &next);
+      if (next == q) break;
+      chunk.values.push_back(v);
+      q = next;
+      while ((q < eol) and isspace(*q)) q++;
+    }
+    unsigned n = chunk.values.size() - offset;
+    if (n != dim){
+      chunk.error = "Word embedding of " + word + " has dim "
+	+ to_string(n) + ", expected " + to_string(dim);
+      return;
+    }
+    chunk.ids.push_back(d.convert(word));
+  }
+}
+
+// map the table of a binary file, nullptr if it is missing
+// or does not match the dict and the text file
+static const float* map_embedding_table(const string& fbin, dynet::Dict& d,
+					unsigned dim, const struct stat& src){
+  int fd = open(fbin.c_str(), O_RDONLY);
+  struct stat st;
+  if ((fd < 0) or (fstat(fd, &st) != 0)){
+    if (fd >= 0) close(fd);
+    return nullptr;
+  }
+  EmbedHeader header;
+  size_t nbytes = sizeof(header) + (size_t)d.size() * dim * sizeof(float);
+  bool b_ok = ((size_t)st.st_size == nbytes)
+    and (read(fd, &header, sizeof(header)) == sizeof(header))
+    and (memcmp(header.magic, EMBED_MAGIC, 8) == 0)
+    and (header.version == EMBED_VERSION) and (header.dim == dim)
+    and (header.vocab_size == d.size())
+    and (header.dict_hash == dict_fingerprint(d))
+    and (header.src_size == (uint64_t)src.st_size)
+    and (header.src_mtime == (int64_t)src.st_mtime);
+  void* addr = MAP_FAILED;
+  // private and writable, the file itself is never changed
+  if (b_ok) addr = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return nullptr;
+  cerr << "Load " << header.n_found << " word embeddings with dim:" << dim
+       << " from " << fbin << " (" << header.vocab_size - header.n_found
+       << " words without one)" << endl;
+  return (const float*)((const char*)addr + sizeof(header));
+}
+
+const float* load_embedding_table(const string& fembed, dynet::Dict& d,
+				  unsigned dim, unsigned nthreads){
+  struct stat src;
+  int fd = open(fembed.c_str(), O_RDONLY);
+  if ((fd < 0) or (fstat(fd, &src) != 0)){
+    cerr << "Cannot open " << fembed << endl;
+    exit(1);
+  }
+  ostringstream os;
+  os << fembed << "." << hex << dict_fingerprint(d) << ".bin";
+  string fbin = os.str();
+  const float* table = map_embedding_table(fbin, d, dim, src);
+  if (table != nullptr){
+    close(fd);
+    return table;
+  }
+  if (nthreads == 0) nthreads = thread::hardware_concurrency();
+  cerr << "Reading word embeddings from " << fembed << " with "
+       << nthreads << " threads" << endl;
+  size_t fsize = src.st_size;
+  void* addr = (fsize > 0) ? mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+  close(fd);
+  if (addr == MAP_FAILED){
+    cerr << "Cannot map " << fembed << endl;
+    exit(1);
+  }
+  // cut into chunks at line boundaries
+  const char* base = (const char*)addr;
+  const char* end = base + fsize;
+  vector<EmbedChunk> chunks;
+  size_t step = fsize / (nthreads * 4) + 1;
+  for (const char* p = base; p < end; ){
+    const char* q = p + min(step, (size_t)(end - p));
+    if (q < end){
+      q = (const char*)memchr(q, '\n', end - q);
+      q = (q == nullptr) ? end : q + 1;
+    }
+    EmbedChunk chunk;
+    chunk.begin = p; chunk.end = q;
+    chunks.push_back(std::move(chunk));
+    p = q;
+  }
+  auto run = [&](unsigned tid){
+    for (unsigned k = tid; k < chunks.size(); k += nthreads)
+      parse_embed_chunk(chunks[k], d, dim, k == 0);
+  };
+  vector<thread> workers;
+  for (unsigned tid = 0; tid < nthreads; tid++) workers.push_back(thread(run, tid));
+  for (auto& worker : workers) worker.join();
+  // fill the table in file order, the first vector of a word wins
+  EmbedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, EMBED_MAGIC, 8);
+  header.version = EMBED_VERSION;
+  header.dim = dim;
+  header.vocab_size = d.size();
+  header.dict_hash = dict_fingerprint(d);
+  header.src_size = src.st_size;
+  header.src_mtime = src.st_mtime;
+  float* values = new float[(size_t)d.size() * dim]();
+  vector<bool> found(d.size(), false);
+  for (auto& chunk : chunks){
+    if (chunk.error.size() > 0){
+      cerr << chunk.error << endl;
+      exit(1);
+    }
+    header.n_vectors += chunk.n_vectors;
+    for (unsigned k = 0; k < chunk.ids.size(); k++){
+      int idx = chunk.ids[k];
+      if (found[idx]) continue;
+      found[idx] = true;
+      header.n_found ++;
+      memcpy(values + (size_t)idx * dim, &chunk.values[(size_t)k * dim], dim * sizeof(float));
+    }
+  }
+  if (addr != nullptr) munmap(addr, fsize);
+  cerr << "Load " << header.n_found << " word embeddings with dim:" << dim
+       << " from " << header.n_vectors << " vectors ("
+       << header.vocab_size - header.n_found << " words without one, "
+       << "coverage " << 100.0 * header.n_found / max(header.vocab_size, (uint32_t)1)
+       << "%)" << endl;
+  // keep a binary copy for later runs
+  string ftmp = fbin + ".tmp";
+  ofstream out(ftmp, ios::binary);
+  out.write((const char*)&header, sizeof(header));
+  out.write((const char*)values, (size_t)d.size() * dim * sizeof(float));
+  out.close();
+  if ((!out.good()) or (rename(ftmp.c_str(), fbin.c_str()) != 0)){
+    cerr << "Cannot write word embeddings to " << fbin << endl;
+    remove(ftmp.c_str());
+  } else {
+    cerr << "Write word embeddings to " << fbin << endl;
+  }
+  return values;
+}
+
+// *******************************************************
+// model checkpoints
+//
+// layout: header, then two sections, each one starting at
+// an 8-byte boundary
+//   sizes  [nparams] uint64  number of values of each param
+//   values [nvalues] float
+// *******************************************************
+struct ModelHeader{
+  char magic[8];
+  uint32_t version;
+  ModelInfo info;
+  uint32_t nparams;
+  uint64_t nvalues;
+  uint64_t checksum; // FNV-1a of the values
+};
+
+static uint64_t value_checksum(const float* values, uint64_t n){
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char* p = (const unsigned char*)values;
+  for (uint64_t i = 0; i < n * sizeof(float); i++){
+    h ^= p[i]; h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// value arrays of all parameters, in checkpoint order
+static vector<pair<float*, uint64_t>> model_values(Model& model){
+  vector<pair<float*, uint64_t>> arrays;
+  for (auto p : model.parameters_list())
+    arrays.push_back(make_pair(p->values.v, (uint64_t)p->values.d.size()));
+  for (auto p : model.lookup_parameters_list())
+    arrays.push_back(make_pair(p->all_values.v, (uint64_t)p->all_values.d.size()));
+  return arrays;
+}
+
+static bool same_info(const ModelInfo& a, const ModelInfo& b){
+  return (a.arch == b.arch) and (a.nlayer == b.nlayer)
+    and (a.inputdim == b.inputdim) and (a.hiddendim == b.hiddendim)
+    and (a.nclass == b.nclass) and (a.ndisrela == b.ndisrela)
+    and (a.vocab_size == b.vocab_size);
+}
+
+static void print_info(const ModelInfo& info){
+  cerr << "arch = " << info.arch << ", nlayer = " << info.nlayer
+       << ", inputdim = " << info.inputdim << ", hiddendim = " << info.hiddendim
+       << ", nclass = " << info.nclass << ", ndisrela = " << info.ndisrela
+       << ", vocab size = " << info.vocab_size << endl;
+}
+
+int load_model(string fname, Model& model, const ModelInfo& info){
+  int fd = open(fname.c_str(), O_RDONLY);
+  struct stat st;
+  if ((fd < 0) or (fstat(fd, &st) != 0)){
+    cerr << "Cannot open " << fname << endl;
+    exit(1);
+  }
+  size_t fsize = st.st_size;
+  char magic[8] = {0};
+  if ((fsize < sizeof(ModelHeader)) or (read(fd, magic, 8) != 8)
+      or (memcmp(magic, MODEL_MAGIC, 8) != 0)){
+    // older checkpoint in a boost text archive
+    close(fd);
+    ifstream in(fname);
+    boost::archive::text_iarchive ia(in);
+    ia >> model;
+    return 0;
+  }
+  void* addr = mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED){
+    cerr << "Cannot map " << fname << endl;
+    exit(1);
+  }
+  const char* base = (const char*)addr;
+  ModelHeader header;
+  memcpy(&header, base, sizeof(header));
+  if (header.version != MODEL_VERSION){
+    cerr << "Model " << fname << " has version " << header.version
+	 << ", expected " << MODEL_VERSION << endl;
+    exit(1);
+  }
+  if (!same_info(header.info, info)){
+    cerr << "Model " << fname << " was trained with" << endl;
+    print_info(header.info);
+    cerr << "but the current model has" << endl;
+    print_info(info);
+    exit(1);
+  }
+  auto arrays = model_values(model);
+  size_t pos = sizeof(header);
+  auto sizes = read_section<uint64_t>(base, fsize, pos, header.nparams);
+  auto values = read_section<float>(base, fsize, pos, header.nvalues);
+  if ((sizes == nullptr) or (values == nullptr)){
+    cerr << "Truncated model file: " << fname << endl;
+    exit(1);
+  }
+  if (header.nparams != arrays.size()){
+    cerr << "Model " << fname << " has " << header.nparams
+	 << " parameters, the current model has " << arrays.size() << endl;
+    exit(1);
+  }
+  // the values are copied by these sizes, so they must add up
+  // to the section read above
+  uint64_t ntotal = 0;
+  for (unsigned i = 0; i < arrays.size(); i++){
+    if (sizes[i] != arrays[i].second){
+      cerr << "Parameter " << i << " in " << fname << " has " << sizes[i]
+	   << " values, the current model has " << arrays[i].second << endl;
+      exit(1);
+    }
+    ntotal += sizes[i];
+  }
+  if (ntotal != header.nvalues){
+    cerr << "Model " << fname << " has " << header.nvalues
+	 << " values, the parameter sizes add up to " << ntotal << endl;
+    exit(1);
+  }
+  if (value_checksum(values, header.nvalues) != header.checksum){
+    cerr << "Checksum error in model file: " << fname << endl;
+    exit(1);
+  }
+  for (auto& arr : arrays){
+    memcpy(arr.first, values, arr.second * sizeof(float));
+    values += arr.second;
+  }
+  munmap(addr, fsize);
+  return 0;
+}
+
+ModelSnapshot snapshot_model(Model& model, const ModelInfo& info){
+  ModelSnapshot snap;
+  snap.info = info;
+  auto arrays = model_values(model);
+  uint64_t n = 0;
+  for (auto& arr : arrays) n += arr.second;
+  snap.values.reserve(n);
+  for (auto& arr : arrays){
+    snap.sizes.push_back(arr.second);
+    snap.values.insert(snap.values.end(), arr.first, arr.first + arr.second);
+  }
+  return snap;
+}
+
+int save_snapshot(const string& fname, const ModelSnapshot& snap){
+  ModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MODEL_MAGIC, 8);
+  header.version = MODEL_VERSION;
+  header.info = snap.info;
+  header.nparams = snap.sizes.size();
+  header.nvalues = snap.values.size();
+  header.checksum = value_checksum(snap.values.data(), snap.values.size());
+  // write to a temporary file, so a crash never leaves a
+  // partial checkpoint behind
+  string ftmp = fname + ".tmp";
+  ofstream out(ftmp, ios::binary);
+  if (!out.good()){
+    cerr << "Cannot write model to " << fname << endl;
+    return 1;
+  }
+  out.write((const char*)&header, sizeof(header));
+  write_section(out, snap.sizes);
+  write_section(out, snap.values);
   out.close();
+  if ((!out.good()) or (rename(ftmp.c_str(), fname.c_str()) != 0)){
+    cerr << "Cannot write model to " << fname << endl;
+    return 1;
+  }
   return 0;
 }
+
+int save_model(string fname, Model& model, const ModelInfo& info){
+  return save_snapshot(fname, snapshot_model(model, info));
+}
+
+void ModelSaver::save(const string& fname, Model& model, const ModelInfo& info){
+  wait();
+  auto snap = make_shared<ModelSnapshot>(snapshot_model(model, info));
+  worker = std::thread([fname, snap](){ save_snapshot(fname, *snap); });
+}
+
+void ModelSaver::wait(){
+  if (worker.joinable()) worker.join();
+}
@@ -15,6 +15,10 @@
 #include <iostream>
 #include <fstream>
 #include <utility>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <memory>
 
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
@@ -28,23 +32,271 @@ using namespace dynet;
 typedef vector<pair<unsigned, float>> Record;
 typedef vector<int> Edu;
 
-struct Doc{
-  vector<Edu> edus; // a collection of EDUs
-  vector<int> order; // topological order of pnodes
-  map<int, vector<int>> tree; // pnode : {children_nodes}
-  map<int, int> relas;
-  int root; // root node
-  unsigned label; // document label
+// a list of node (or token) indices, viewed in place
+struct NodeList{
+  const int* first;
+  const int* last;
+  const int* begin() const {return first;}
+  const int* end() const {return last;}
+  unsigned size() const {return last - first;}
+  bool empty() const {return first == last;}
+  int operator[](unsigned i) const {return first[i];}
+};
+
+// the token ids of an EDU, in the token buffer of a corpus
+typedef NodeList EduView;
+
+// *******************************************************
+// Corpus storage
+//
+// All docs of a corpus share one store: the token ids of
+// every EDU in one buffer, and the tree of every doc in a
+// few flat tables. A Doc is a fixed-size view into the
+// store, so neither parsing nor copying a doc allocates
+// anything per EDU. The tree of a doc is in CSR form: the
+// children of pnode i are its child_nodes[child_offsets[i]
+// .. child_offsets[i+1]), in the order of the input file.
+// Docs are only appended, never modified
+// *******************************************************
+struct CorpusStore{
+  vector<int> tokens; // token ids of all EDUs
+  vector<uint64_t> edu_toks; // EDU i: tokens[edu_toks[i] .. edu_toks[i+1])
+  vector<int> relas; // relation index of each EDU
+  vector<int> order; // topological order of pnodes, doc by doc
+  vector<int> level_nodes; // the same pnodes, grouped by height
+  vector<unsigned> child_offsets; // n_edu + 1 per doc, into its child_nodes
+  vector<int> child_nodes;
+  vector<unsigned> level_offsets; // n_level + 1 per doc, into its level_nodes
+  vector<char> chars; // filenames
+
+  CorpusStore(): edu_toks(1, 0) {}
+};
+
+// where a doc is in the store; also the record of a doc in
+// a compiled corpus
+struct DocEntry{
+  uint64_t edu_first = 0; // its EDUs and their relas
+  uint64_t order_first = 0; // its order and level_nodes
+  uint64_t child_first = 0; // its child_offsets
+  uint64_t node_first = 0; // its child_nodes
+  uint64_t level_first = 0; // its level_offsets
+  uint64_t name_first = 0; // its filename
+  uint32_t n_edu = 0;
+  uint32_t n_order = 0; // pnodes reachable from the root
+  uint32_t n_level = 0;
+  uint32_t name_len = 0;
+  int32_t root = -1; // root node
+  uint32_t label = 0; // document label
+};
+
+struct Doc : public DocEntry{
+  const CorpusStore* store = nullptr;
+
+  unsigned n_edus() const {return n_edu;}
+
+  EduView edu(unsigned eidx) const {
+    const uint64_t* offsets = store->edu_toks.data() + edu_first;
+    const int* base = store->tokens.data();
+    return EduView{base + offsets[eidx], base + offsets[eidx+1]};
+  }
+
+  int rela(unsigned eidx) const {return store->relas[edu_first + eidx];}
+
+  // topological order of pnodes
+  NodeList order() const {
+    const int* base = store->order.data() + order_first;
+    return NodeList{base, base + n_order};
+  }
+
+  NodeList children(int pidx) const {
+    const unsigned* offsets = store->child_offsets.data() + child_first;
+    const int* base = store->child_nodes.data() + node_first;
+    return NodeList{base + offsets[pidx], base + offsets[pidx+1]};
+  }
+
+  unsigned n_levels() const {return n_level;}
+
+  // pnodes of height h (0: leaves)
+  NodeList level(unsigned h) const {
+    const unsigned* offsets = store->level_offsets.data() + level_first;
+    const int* base = store->level_nodes.data() + order_first;
+    return NodeList{base + offsets[h], base + offsets[h+1]};
+  }
+
+  unsigned n_tokens() const {
+    const uint64_t* offsets = store->edu_toks.data() + edu_first;
+    return offsets[n_edu] - offsets[0];
+  }
+
+  string filename() const {
+    const char* base = store->chars.data() + name_first;
+    return string(base, base + name_len);
+  }
+};
+
+// a doc being parsed: the EDUs in input order, and the
+// pnode and the relation of each EDU index
+struct DocDraft{
+  vector<int> tokens;
+  vector<uint64_t> edu_ends; // end of each EDU in tokens
+  vector<int> parents;
+  vector<int> relas;
+  int root = -1;
+  unsigned label = 0;
   string filename;
+
+  unsigned n_edus() const {return edu_ends.size();}
+  void add_edu(const Edu& edu){
+    tokens.insert(tokens.end(), edu.begin(), edu.end());
+    edu_ends.push_back(tokens.size());
+  }
+  void clear(){
+    tokens.clear(); edu_ends.clear(); parents.clear(); relas.clear();
+    root = -1; label = 0; filename.clear();
+  }
+};
+
+// the arrays of a store, in memory or in a mapped compiled
+// corpus
+struct StoreArrays{
+  const int* tokens;
+  const uint64_t* edu_toks;
+  const int* relas;
+  const int* order;
+  const int* level_nodes;
+  const unsigned* child_offsets;
+  const int* child_nodes;
+  const unsigned* level_offsets;
+  const char* chars;
 };
 
-typedef vector<Doc> Corpus;
+class Corpus{
+public:
+  Corpus(): store(make_shared<CorpusStore>()) {}
+  size_t size() const {return docs.size();}
+  bool empty() const {return docs.empty();}
+  const Doc& operator[](size_t i) const {return docs[i];}
+  vector<Doc>::const_iterator begin() const {return docs.begin();}
+  vector<Doc>::const_iterator end() const {return docs.end();}
+  // drop all docs, keeping the buffers if not shared
+  void clear();
+  // build the tree of a parsed doc and append it
+  void add_doc(const DocDraft& draft);
+  // append a copy of a doc of another corpus
+  void add_doc(const Doc& doc);
+  // append a copy of a doc whose arrays are elsewhere
+  void add_doc(const DocEntry& entry, const StoreArrays& from);
+  // append copies of all docs of another corpus
+  void append(const Corpus& other);
+  // map every token id w to idmap[w]
+  void remap_tokens(const vector<int>& idmap);
+  // bytes held by the docs and their store
+  size_t n_bytes() const;
+private:
+  friend int save_compiled_corpus(string fname, const Corpus& corpus, dynet::Dict& d);
+  friend Corpus load_compiled_corpus(const string& fname, dynet::Dict* dptr);
+  // shared by the copies of a corpus, so the docs stay
+  // valid when the corpus is moved or copied
+  shared_ptr<CorpusStore> store;
+  vector<Doc> docs;
+};
 
 Edu read_edu(const string& line, dynet::Dict* dptr, bool b_update);
 
-Corpus read_corpus(char* filename, dynet::Dict* dptr, bool b_update);
+// builds docs from the lines of the corpus format, one line
+// at a time (the title line of a file is not expected)
+class DocParser{
+public:
+  // a lenient parser skips the malformed docs instead of
+  // exiting; nrela > 0 bounds the relation indices
+  DocParser(dynet::Dict* dptr, bool b_update, bool b_lenient = false,
+	    unsigned nrela = 0):
+    dptr(dptr), b_update(b_update), b_lenient(b_lenient), nrela(nrela) {}
+  // return true when the line ends a non-empty doc, which
+  // is appended to corpus; a lenient parser also returns
+  // true for a skipped doc, with the reason in error()
+  bool add_line(const string& line, Corpus& corpus);
+  // the last doc, if it is not ended by a '=' line
+  bool flush(Corpus& corpus);
+  // why the last ended doc was skipped, empty if it was not
+  const string& error() const {return err;}
+private:
+  dynet::Dict* dptr;
+  bool b_update;
+  bool b_lenient;
+  unsigned nrela;
+  DocDraft cur;
+  string cur_err; // the first error of cur
+  string err;
+  void fail(const string& msg);
+  bool check_tree();
+};
 
-vector<int> topological_sorting(Doc& doc);
+// a compiled corpus mapped in place; docs are copied out one
+// at a time, so only the pages in use are kept in memory
+class MappedCorpus{
+public:
+  MappedCorpus(const string& fname, dynet::Dict* dptr);
+  ~MappedCorpus();
+  size_t size() const {return ndocs;}
+  // append a copy of doc i to corpus
+  void copy_doc(size_t i, Corpus& corpus) const {corpus.add_doc(entries[i], arrays);}
+private:
+  MappedCorpus(const MappedCorpus&) = delete;
+  MappedCorpus& operator=(const MappedCorpus&) = delete;
+  const char* base;
+  size_t fsize;
+  uint64_t ndocs;
+  const DocEntry* entries;
+  StoreArrays arrays;
+};
+
+// reads the docs of a corpus file one at a time, without
+// updating the dict. A compiled corpus is mapped, not loaded
+class CorpusReader{
+public:
+  CorpusReader(const string& fname, dynet::Dict* dptr);
+  // append the next doc to corpus, false at the end of the file
+  bool next(Corpus& corpus);
+private:
+  ifstream in;
+  DocParser parser;
+  unique_ptr<MappedCorpus> compiled;
+  size_t pos = 0; // next doc in compiled
+  bool b_done = false;
+};
+
+// number of docs in a corpus file, text or compiled, without
+// reading them
+size_t count_docs(const string& fname);
+
+// nthreads: 1 for the serial reader, 0 for all cores
+Corpus read_corpus(char* filename, dynet::Dict* dptr, bool b_update,
+		   unsigned nthreads = 1);
+
+Corpus read_corpus_parallel(char* filename, dynet::Dict* dptr,
+			    bool b_update, unsigned nthreads);
+
+// compiled (binary) corpus, written by --task compile
+const char CORPUS_MAGIC[8] = "DTCCORP";
+const uint32_t CORPUS_VERSION = 2;
+
+bool is_compiled_corpus(const string& fname);
+
+int save_compiled_corpus(string fname, const Corpus& corpus, dynet::Dict& d);
+
+Corpus load_compiled_corpus(const string& fname, dynet::Dict* dptr);
+
+uint64_t dict_fingerprint(dynet::Dict& d);
+
+vector<int> topological_sorting(const Doc& doc);
+
+vector<vector<unsigned>> make_batches(const Corpus& corpus, unsigned batchsize,
+				      bool b_bucket, std::mt19937& rng);
+
+// batches over a subset of the docs
+vector<vector<unsigned>> make_batches(const Corpus& corpus, const vector<unsigned>& subset,
+				      unsigned batchsize, bool b_bucket, std::mt19937& rng);
 
 void print_int_vector(const vector<int>&);
 
@@ -54,8 +306,70 @@ int save_dict(string, dynet::Dict&);
 
 int load_dict(string, dynet::Dict&);
 
-int load_model(string fname, Model& model);
+// *******************************************************
+// Pretrained word embeddings
+//
+// The text file (one word and its vector per line) is
+// parsed by nthreads threads (0: all cores), keeping only
+// the words in the dict. The result is written next to it
+// (fembed.<dict fingerprint>.bin) with row i for word i and
+// zeros for words without a vector; later runs with the
+// same dict map that file directly
+// *******************************************************
+const char EMBED_MAGIC[8] = "DTCEMBD";
+const uint32_t EMBED_VERSION = 1;
+
+// vocab_size x dim values, valid for the whole run
+const float* load_embedding_table(const string& fembed, dynet::Dict& d,
+				  unsigned dim, unsigned nthreads = 0);
+
+// *******************************************************
+// Model checkpoints
+//
+// A header with the model configuration and a checksum,
+// then the sizes and the values of all parameters (dense
+// ones first, then lookup ones), in 8-byte aligned sections.
+// Files written by older versions (boost text archives) can
+// still be loaded
+// *******************************************************
+const char MODEL_MAGIC[8] = "DTCMODL";
+const uint32_t MODEL_VERSION = 1;
+
+// model configuration stored with a checkpoint
+struct ModelInfo{
+  uint32_t arch;
+  uint32_t nlayer;
+  uint32_t inputdim;
+  uint32_t hiddendim;
+  uint32_t nclass;
+  uint32_t ndisrela;
+  uint32_t vocab_size;
+};
+
+// parameter values copied out of a model
+struct ModelSnapshot{
+  ModelInfo info;
+  vector<uint64_t> sizes;
+  vector<float> values;
+};
+
+ModelSnapshot snapshot_model(Model& model, const ModelInfo& info);
+
+int save_snapshot(const string& fname, const ModelSnapshot& snap);
 
-int save_model(string fname, Model& model);
+int load_model(string fname, Model& model, const ModelInfo& info);
+
+int save_model(string fname, Model& model, const ModelInfo& info);
+
+// takes a snapshot on the calling thread and writes it on a
+// background thread; a new save waits for the previous one
+class ModelSaver{
+public:
+  ~ModelSaver() { wait(); }
+  void save(const string& fname, Model& model, const ModelInfo& info);
+  void wait();
+private:
+  std::thread worker;
+};
 
 #endif